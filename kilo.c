@@ -6,21 +6,65 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KILO_X86 1
+#endif
+
 /*** define ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_ROW_CACHE 1024 // materialised rows kept in memory, power of two
+#define KILO_ROW_BUDGET (8 << 20) // render and hl bytes kept for offscreen rows
+#define KILO_ROW_WINDOW (1 << 16) // rows wider than this are only rendered around the view
+#define KILO_ROW_MARGIN 1024 // render columns kept either side of the view
+#define KILO_HL_CHUNK 4096 // render columns between highlighter checkpoints
+#define KILO_HL_BATCH (1 << 18) // render columns highlighted at a time to reach the view
+#define KILO_HL_LOOKAHEAD 256 // longer than any keyword or comment delimiter
+#define KILO_STATE_BLOCK 4096 // lines per block of struct lineStates
+#define KILO_ARENA_CHUNK (256 << 10) // bytes the row arena takes from malloc() at a time
+#define KILO_ARENA_CLASSES 13 // block sizes 16 << 0 .. 16 << 12, larger ones are malloc()ed
+#define KILO_IDLE_NS 5000000 // highlighter work per idle tick
+#define KILO_FRAME_NS 8000000 // least time between frames while input streams in
+#define KILO_SAVE_IOV 1024 // iovecs per writev() when saving
+#define KILO_SAVE_BATCH (8 << 20) // bytes per writev() when saving
+#define KILO_SAVE_TICK_MS 100 // redraws of the save progress
+#define KILO_UNDO_MAX (16 << 20) // default bytes of undo history kept, see E.undo_max
+#define KILO_FIND_MAX (1 << 23) // matches kept for navigation, more are only counted
+#define KILO_FIND_PAR_MIN (4 << 20) // documents smaller than this are searched by one thread
+#define KILO_FIND_CHUNK (1 << 20) // least bytes per search job
+#define KILO_FIND_THREADS 64
+#define KILO_RE_LENGTH 4096 // longest pattern
+#define KILO_RE_DEPTH 64 // groups nested in a pattern
+#define KILO_RE_REPEAT 1000 // largest count in {m,n}
+#define KILO_RE_STATES (1 << 16) // NFA states per pattern
+#define KILO_RE_DSTATES 4096 // DFA states kept before the cache starts over
+#define KILO_RE_HASH 8192 // slots of the DFA state table, power of two
+#define KILO_BENCH_ROWS 40 // terminal size of a benchmark run, see benchMain()
+#define KILO_BENCH_COLS 120
+#define KILO_BENCH_LINE 4096 // longest line of a benchmark script
+#define KILO_TRACE_EVENTS (1 << 20) // trace events kept for KILO_TRACE, the newest
 
 #define CRTL_KEY(k) ((k) & 0x1f) // 1 = 0001, f = 1111 => 00011111 in binary 
 
@@ -34,7 +78,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START // ESC[200~, the text that follows is pasted
 };
 
 enum editorHighlight {
@@ -48,11 +93,62 @@ enum editorHighlight {
   HL_MATCH
 };
 
+// What the timers of struct perfState measure
+enum perfSpan {
+  PERF_KEY = 0, // handling one key
+  PERF_WAIT, // for input
+  PERF_LOAD, // editorOpen()
+  PERF_HIGHLIGHT, // one row, see editorUpdateSyntax()
+  PERF_IDLE, // highlighting ahead while waiting for input
+  PERF_FRAME, // all of editorRefreshScreen()
+  PERF_RENDER, // drawing the frame into its grid
+  PERF_DIFF, // turning what changed into escape sequences
+  PERF_WRITE, // write() to the terminal
+  PERF_SEARCH, // one findUpdate()
+  PERF_SPANS
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Byte classes for the highlighter
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_QUOTE (1<<2) // starts a string
+#define CC_COMMENT (1<<3) // first byte of a comment delimiter
+#define CC_WORD (1<<4) // none of the above except digit: inert inside a word
+#define CC_BLANK (1<<5) // space or tab
+
+// Cell bytes of a struct screenGrid that aren't the character itself
+#define GRID_GLYPH '\x80'
+#define GRID_WIDE '\x81'
+
+// Cell attributes: an SGR foreground colour, 0 for the default, plus reverse
+#define ATTR_COLOR 0x7f
+#define ATTR_REVERSE 0x80
+
+// Render byte in each column of a non-ASCII character. The highlighter
+// takes it for part of a word.
+#define RENDER_GLYPH '\x80'
+
+// A dirty render implies a dirty hl, both are rebuilt on first use
+#define ROW_RENDER_DIRTY (1<<0)
+#define ROW_HL_DIRTY (1<<1)
+
 /*** data ***/
 
+// Lookup tables built from an HLDB entry, see editorCompileSyntax()
+struct syntaxTables {
+  unsigned char cc[256]; // CC_* class bits of every byte
+  int skip_ok; // the vector skips in editorHighlightSpan() agree with cc
+  // keywords as a trie: kw_cls maps a byte to its column, 0 if it is in
+  // no keyword; kw_next has kw_ncls columns per state, 0 = no transition
+  unsigned char kw_cls[256];
+  int kw_ncls;
+  int *kw_next;
+  unsigned char *kw_accept; // per state: HL_KEYWORD1/2 if a keyword ends here
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -61,18 +157,267 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct syntaxTables *tables;
+};
+
+// A character of a row that isn't one byte in one render column: a tab or
+// anything outside ASCII. rx is the render column right after it.
+struct rowGlyph {
+  int cx;
+  int rx;
+  unsigned char len; // bytes in chars
+  unsigned char width; // render columns, 0 for a combining mark
+};
+
+// The highlighter's state at the start of render column rx, see
+// editorHighlightSpan()
+struct hlState {
+  int rx;
+  unsigned char in_comment;
+  unsigned char is_string; // the quote that opened it
+  unsigned char prev_separator;
+  unsigned char prev_hl; // hl of column rx - 1
+  unsigned char line_comment; // the rest of the row is a single-line comment
 };
 
 typedef struct editor_row {
-  int idx;
+  int line; // set by editorRowAt(), stale once lines above come or go
   int size;
   int rsize;
-  char *chars;
+  int render_off; // render column of render[0] and hl[0]
+  char *chars; // NULL while the slot holds no line
   char *render;
   unsigned char *hl;
-  int hl_open_comment;
+  struct rowGlyph *glyphs; // those before column glyphs_scanned, see editorRowGlyphs()
+  int nglyphs;
+  int glyphs_scanned;
+  struct hlState *hlcp; // checkpoints of wide rows, every KILO_HL_CHUNK columns
+  int nhlcp;
+  size_t chars_cap, render_cap, hl_cap, glyphs_cap, hlcp_cap; // block sizes, see arenaAlloc()
+  int dirty; // ROW_*_DIRTY bits
 } editor_row;
 
+enum ptBufferType {
+  PT_ORIG = 0,
+  PT_ADD
+};
+
+// A text buffer plus the offset of every '\n' in it, ascending
+struct ptBuffer {
+  char *b;
+  size_t len;
+  size_t cap;
+  int mapped; // b is an mmap() of the file rather than a malloc()
+  dev_t dev; // the file mapped, see editorLoadFile()
+  ino_t ino;
+  int pinned; // a save is reading b, so growing it mustn't free the old block
+  char **retired; // old blocks kept for the save
+  int nretired;
+  size_t *nl;
+  size_t nlcount;
+  size_t nlcap;
+};
+
+// One node of the piece treap: a byte range of one of the buffers, plus
+// byte and newline totals of its whole subtree
+struct piece {
+  struct piece *left, *right;
+  unsigned int prio;
+  int buf;
+  size_t off;
+  size_t len;
+  size_t nl;
+  size_t sum_len;
+  size_t sum_nl;
+};
+
+struct pieceTable {
+  struct ptBuffer bufs[2];
+  struct piece *root;
+  unsigned int seed;
+};
+
+struct stateBlock {
+  int count;
+  unsigned char s[KILO_STATE_BLOCK];
+};
+
+struct lineStates {
+  struct stateBlock **b;
+  int nblocks;
+  int last, last_first; // block of the previous lookup and its first line
+};
+
+// A block above the largest size class, see arenaAlloc()
+struct arenaLarge {
+  struct arenaLarge *prev, *next;
+};
+
+// Where row text, render and hl live: power of two size classes carved
+// from big chunks, each class with a free list
+struct rowArena {
+  void *free[KILO_ARENA_CLASSES]; // linked through the blocks themselves
+  char *bump; // unused rest of the newest chunk
+  size_t bump_left;
+  char **chunks;
+  int nchunks;
+  struct arenaLarge *large;
+  long long allocs; // blocks handed out
+  long long mallocs; // calls to malloc() that took
+  size_t held; // bytes taken from malloc()
+  size_t used; // bytes in blocks handed out
+};
+
+// Bytes read from the terminal and not decoded yet
+struct inputBuffer {
+  char *b;
+  size_t pos, len, cap;
+};
+
+// A byte range of one of the piece table's buffers, to be written out
+struct saveSpan {
+  const char *p;
+  size_t len;
+  int mapped; // part of a mapped file, whose pages can be dropped
+};
+
+// A save running on a thread of its own, see editorSave()
+struct saveState {
+  int active;
+  pthread_t thread;
+  int pipe[2]; // the thread writes a byte when done
+  struct saveSpan *spans;
+  int nspans;
+  size_t total;
+  size_t written; // so far, added to by the thread
+  char *filename;
+  struct ptBuffer source; // the original text as it was, see editorWriteFile()
+  int buffer; // being saved, see editorSaveFinish()
+  int dirty; // its dirty count when the snapshot was taken
+  int result, error; // of editorWriteFile() and its errno
+};
+
+// Text that left or entered the document: a byte range of one of the
+// piece table's buffers, which never change once written
+struct undoSpan {
+  int buf;
+  size_t off;
+  size_t len;
+};
+
+// One insertion or deletion of len bytes at pos, plus where those bytes are
+struct undoRecord {
+  size_t pos;
+  size_t len;
+  int insert;
+  int step; // records of one step are undone together
+  int nspans;
+  struct undoSpan s[];
+};
+
+// r[0..done) can be undone, r[done..count) redone
+struct undoLog {
+  struct undoRecord **r;
+  int count, done, cap;
+  int step; // of the newest record
+  int open; // the next record joins that step
+  int run; // kind of the last key, see editorUndoKey()
+  size_t bytes;
+};
+
+struct findMatch {
+  int line;
+  int col; // in chars
+  int len;
+};
+
+// The matches of the last search query, in document order
+struct findState {
+  int active; // the find prompt is up
+  int regex; // the query is a regular expression
+  char *query;
+  struct regex *re; // query compiled, if regex
+  struct reMatcher *rm; // for searching lines on the main thread
+  const char *error; // why query doesn't compile, or NULL
+  struct findMatch *m;
+  int count; // matches in m
+  int cap;
+  long long total; // all matches, including those past KILO_FIND_MAX
+  int current; // index in m of the match shown, -1 if none
+};
+
+// A non-ASCII character in a cell, with the combining marks on it
+struct gridGlyph {
+  unsigned char len;
+  char b[7];
+};
+
+// A screenful of cells, one byte and one ATTR_* attribute each. A cell
+// holding a non-ASCII character has the byte GRID_GLYPH and the character
+// in glyphs, the cell covered by the right half of a double-width one
+// GRID_WIDE.
+struct screenGrid {
+  int rows, cols;
+  char *chars;
+  unsigned char *attrs;
+  struct gridGlyph *glyphs;
+  char *glyph_rows; // per row: some cell of it is GRID_GLYPH or GRID_WIDE
+};
+
+// What each open file has of its own. The current one is in E, the others
+// wait in E.buffers, see editorSwitchBuffer().
+struct editorBuffer {
+  int cursor_x, cursor_y;
+  int render_x;
+  int row_offset;
+  int col_offset;
+  int numrows;
+  editor_row *row;
+  int *row_slot;
+  int row_head;
+  int row_first;
+  size_t row_bytes;
+  struct pieceTable pt;
+  struct lineStates hl;
+  int hl_frontier;
+  int hl_known;
+  int dirty;
+  char *filename;
+  struct editorSyntax *syntax;
+  struct undoLog undo;
+};
+
+struct benchState {
+  int active; // running a script, see benchMain()
+  int no_temp; // saves act as if no temp file could be made
+  int record; // fd input is copied to for a later replay (KILO_RECORD), or -1
+};
+
+struct perfCounters {
+  long long ns[PERF_SPANS];
+  long long count[PERF_SPANS];
+  long long out_bytes; // written to the terminal
+};
+
+struct perfEvent {
+  long long start, dur;
+  int span;
+  int arg; // see perf_args
+};
+
+// Where the time goes, see perfBegin() and perfEnd()
+struct perfState {
+  struct perfCounters total;
+  struct perfCounters frame; // of the last frame, for the overlay
+  struct perfCounters frame_start; // total when the frame being drawn began
+  long long latency_ns; // of the last frame, from the input it paints
+  int hud; // the overlay is on, see editorDrawMessageBar()
+  char *trace_path; // KILO_TRACE: a Chrome trace of the run is written here
+  struct perfEvent *trace; // ring of the newest events
+  long long ntrace; // events recorded, the ring holds the last of them
+  long long t0;
+};
+
 struct editorConfig {
   int cursor_x, cursor_y;
   int render_x;
@@ -81,12 +426,40 @@ struct editorConfig {
   int screen_rows;
   int screen_cols;
   int numrows;
-  editor_row *row;
+  editor_row *row; // slots of materialised rows, see editorRowAt()
+  int *row_slot; // window position -> slot, a ring starting at row_head
+  int row_head;
+  int row_first; // line at window position 0
+  struct rowArena arena; // memory of the rows
+  size_t row_bytes; // render and hl memory held by materialised rows
+  struct pieceTable pt;
+  struct lineStates hl; // per line: a multi-line comment is open at its end
+  int hl_frontier; // hl states of lines before this one are up to date
+  int hl_known; // lines before this one have been through the highlighter
   int dirty;
   char *filename;
-  char statusmsg[80];
+  char statusmsg[128];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct screenGrid frame; // being drawn, see editorRefreshScreen()
+  struct screenGrid shadow; // what the terminal shows
+  int shadow_valid; // 0 repaints everything on the next refresh
+  int hl_stale; // a row on screen was drawn from a line state that changed since
+  struct inputBuffer input;
+  struct findState find;
+  struct saveState save;
+  struct undoLog undo;
+  size_t undo_max; // KILO_UNDO_MAX: bytes of undo history kept, oldest steps go first
+  struct editorBuffer *buffers; // every open file; the current one's entry is stale
+  int nbuffers;
+  int buffer; // the current one
+  int sigfd; // signalfd() for SIGWINCH
+  long long frame_ns; // when the last frame was written, see editorClock()
+  long long input_ns; // when the oldest input not yet painted arrived, or 0
+  long long lat_sum_ns, lat_max_ns; // keystroke to paint, over lat_frames
+  int lat_frames;
+  struct benchState bench;
+  struct perfState perf;
   struct termios orig_termios;
 };
 
@@ -109,7 +482,8 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
 };
 
@@ -120,6 +494,29 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+editor_row *editorRowAt(int at);
+editor_row *editorRowSlot(int pos);
+editor_row *editorRowCached(int at);
+char *editorLineText(int at, int *lenp);
+const char *findMemmem(const char *h, size_t hlen, const char *n, size_t nlen);
+void editorRowLoad(editor_row *row, int at);
+void editorFreeRow(editor_row *row);
+void editorSyntaxIdle();
+int editorPollInput(int timeout);
+void editorSaveFinish();
+void editorSaveWait();
+int *editorBufferDirty(int i);
+void editorWaitInput();
+void editorRowRender(editor_row *row, int from, int to);
+void editorRowAddCheckpoint(editor_row *row, struct hlState *cp);
+int editorRowCursorXToRenderX(editor_row *row, int cursor_x);
+void editorScroll();
+size_t editorRowBytes(editor_row *row);
+void editorDocInsert(size_t pos, const char *s, size_t len);
+void editorDocDelete(size_t pos, size_t len);
+void initEditor();
+long long perfBegin();
+void perfEnd(int span, long long start, int arg);
 
 /*** terminal ***/
 
@@ -133,6 +530,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -154,34 +552,121 @@ void enableRawMode() {
   raw.c_cc[VTIME] = 1;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+  // Have the terminal mark pasted text, see editorPaste()
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Monotonic time in nanoseconds
+long long editorClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Read whatever the terminal has ready in one go, waiting at most the VTIME
+// timeout for the first byte. Returns the number of bytes read.
+int editorFillInput() {
+  struct inputBuffer *in = &E.input;
+  if (in->pos > 0) {
+    memmove(in->b, &in->b[in->pos], in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+  }
+  if (in->cap - in->len < 4096) {
+    in->cap = in->cap ? in->cap * 2 : 4096;
+    in->b = realloc(in->b, in->cap);
+  }
+  int nread = read(STDIN_FILENO, &in->b[in->len], in->cap - in->len);
+  if (nread == -1 && errno != EAGAIN) die("read");
+  if (nread <= 0) return 0;
+  if (E.bench.record != -1) write(E.bench.record, &in->b[in->len], nread);
+  in->len += nread;
+  if (E.input_ns == 0) E.input_ns = editorClock();
+  return nread;
+}
+
+// Next input byte, 0 if none arrived within 100ms
+int editorInputByte(char *c) {
+  // A script queues whole keys, see benchKeys()
+  if (E.input.pos == E.input.len && (E.bench.active || !editorPollInput(100))) return 0;
+  *c = E.input.b[E.input.pos++];
+  return 1;
+}
+
+// After PASTE_START: everything up to ESC[201~ is pasted text. Returns it
+// in place in the input buffer, line breaks as \n, valid until the next read.
+char *editorReadPaste(size_t *lenp) {
+  struct inputBuffer *in = &E.input;
+  size_t scanned = 0; // bytes after pos known not to start the end marker
+  int idle = 0;
+  char *end = NULL;
+  for (;;) {
+    if (in->len - in->pos > scanned) {
+      end = memmem(&in->b[in->pos + scanned], in->len - in->pos - scanned, "\x1b[201~", 6);
+      if (end) break;
+      scanned = in->len - in->pos;
+      scanned = scanned > 5 ? scanned - 5 : 0;
+    }
+    if (editorFillInput()) {
+      idle = 0;
+    } else if (++idle == 10) {
+      break; // the terminal never closed the paste, take what came
+    }
+  }
+
+  char *text = &in->b[in->pos];
+  size_t len = end ? (size_t)(end - text) : in->len - in->pos;
+  in->pos += end ? len + 6 : len;
+
+  // Terminals send line breaks as \r
+  size_t j = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (text[i] == '\r') {
+      text[j++] = '\n';
+      if (i + 1 < len && text[i + 1] == '\n') i++;
+    } else {
+      text[j++] = text[i];
+    }
+  }
+  *lenp = j;
+  return text;
 }
 
 int editorReadKey() {
-  int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) { // nread = number of byte
-    if (nread == -1 && errno != EAGAIN) die("read");
+  while (!editorInputByte(&c)) {
+    if (E.bench.active) return '\x1b'; // the script ran out in a prompt
+    long long start = perfBegin();
+    editorWaitInput();
+    perfEnd(PERF_WAIT, start, 0);
   }
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!editorInputByte(&seq[0])) return '\x1b';
+    if (!editorInputByte(&seq[1])) return '\x1b';
 
     // Check if it have [ and then check if it PAGE_UP or ARROW_KEY if not return ESC
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        int num = seq[1] - '0';
+        for (;;) {
+          if (!editorInputByte(&seq[2])) return '\x1b';
+          if (seq[2] < '0' || seq[2] > '9') break;
+          num = num * 10 + seq[2] - '0';
+        }
         if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
+          switch (num) {
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200: return PASTE_START;
           }
         }
       } else {
@@ -202,7 +687,8 @@ int editorReadKey() {
       }
       return '\x1b';
   } else {
-      return c;
+      // Bytes of UTF-8 text come as 128..255
+      return (unsigned char)c;
   }
 }
 
@@ -246,473 +732,3986 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** syntax highlighting ***/
-
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void editorHandleResize() {
+  struct signalfd_siginfo si;
+  while (read(E.sigfd, &si, sizeof(si)) == sizeof(si));
+  if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) die("getWindowSize");
+  E.screen_rows -= 2;
+  editorRefreshScreen();
 }
 
-void editorUpdateSyntax(editor_row *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+// Wait up to timeout ms (-1 for ever) for input, dealing with window
+// resizes that come in meanwhile. Returns whether input is buffered.
+int editorPollInput(int timeout) {
+  struct pollfd fds[3] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { E.sigfd, POLLIN, 0 },
+    { E.save.active ? E.save.pipe[0] : -1, POLLIN, 0 }
+  };
+  if (E.input.pos < E.input.len) timeout = 0;
+  if (poll(fds, 3, timeout) == -1) {
+    if (errno == EINTR) return E.input.pos < E.input.len;
+    die("poll");
+  }
+  if (fds[1].revents & POLLIN) editorHandleResize();
+  if (fds[2].revents & POLLIN) {
+    editorSaveFinish();
+    editorRefreshScreen();
+  }
+  if (fds[0].revents) {
+    if (!editorFillInput() && (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+      die("read");
+  }
+  return E.input.pos < E.input.len;
+}
 
-  if (E.syntax == NULL) return;
+// Block until there is input, without using CPU except for what has to be
+// done meanwhile: highlighting the rest of the file, taking the status
+// message down when it times out, and showing how a save is getting on
+void editorWaitInput() {
+  for (;;) {
+    int timeout = -1;
+    if (E.statusmsg[0]) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      long long left = (E.statusmsg_time + 5) * 1000LL -
+                       (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+      if (left <= 0) {
+        E.statusmsg[0] = '\0';
+        editorRefreshScreen();
+        continue;
+      }
+      timeout = left;
+    }
+    if (E.save.active && (timeout == -1 || timeout > KILO_SAVE_TICK_MS))
+      timeout = KILO_SAVE_TICK_MS;
+    if (E.syntax && E.hl_frontier < E.numrows) timeout = 0;
+
+    if (editorPollInput(timeout)) return;
+    if (timeout == 0) {
+      editorSyntaxIdle();
+      if (E.hl_stale) editorRefreshScreen();
+    }
+    if (E.save.active && editorClock() - E.frame_ns >= KILO_SAVE_TICK_MS * 1000000LL)
+      editorRefreshScreen();
+  }
+}
 
-  char **keywords = E.syntax->keywords;
+/*** perf ***/
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+const char *perf_names[PERF_SPANS] = {
+  "key", "wait", "load", "highlight", "idle highlight", "frame", "render",
+  "diff", "write", "search"
+};
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+// What the arg of an event is, where it has one
+const char *perf_args[PERF_SPANS] = {
+  "key", NULL, "lines", "line", NULL, "bytes", NULL, NULL, NULL, "matches"
+};
 
-  int prev_separator = 1;
-  int is_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+long long perfBegin() {
+  return editorClock();
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void perfEnd(int span, long long start, int arg) {
+  struct perfState *p = &E.perf;
+  long long end = editorClock();
+  p->total.ns[span] += end - start;
+  p->total.count[span]++;
+  if (p->trace_path == NULL) return;
+
+  if (p->trace == NULL) p->trace = malloc(sizeof(struct perfEvent) * KILO_TRACE_EVENTS);
+  struct perfEvent *ev = &p->trace[p->ntrace++ % KILO_TRACE_EVENTS];
+  ev->start = start;
+  ev->dur = end - start;
+  ev->span = span;
+  ev->arg = arg;
+}
 
-    // Comment Highlight
-    if (scs_len && !is_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+// d = a - b
+void perfDiff(struct perfCounters *d, struct perfCounters *a, struct perfCounters *b) {
+  for (int i = 0; i < PERF_SPANS; i++) {
+    d->ns[i] = a->ns[i] - b->ns[i];
+    d->count[i] = a->count[i] - b->count[i];
+  }
+  d->out_bytes = a->out_bytes - b->out_bytes;
+}
 
-    if (mcs_len && mce_len && !is_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_separator = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
+// The events kept, oldest first, as a file chrome://tracing and Perfetto load
+void perfTraceWrite() {
+  struct perfState *p = &E.perf;
+  if (p->trace_path == NULL || p->ntrace == 0) return;
+  FILE *fp = fopen(p->trace_path, "w");
+  if (fp == NULL) return;
+
+  long long first = p->ntrace > KILO_TRACE_EVENTS ? p->ntrace - KILO_TRACE_EVENTS : 0;
+  int pid = getpid();
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (long long i = first; i < p->ntrace; i++) {
+    struct perfEvent *ev = &p->trace[i % KILO_TRACE_EVENTS];
+    fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f",
+            perf_names[ev->span], pid, (ev->start - p->t0) / 1000.0, ev->dur / 1000.0);
+    if (perf_args[ev->span])
+      fprintf(fp, ",\"args\":{\"%s\":%d}", perf_args[ev->span], ev->arg);
+    fprintf(fp, "}%s\n", i + 1 < p->ntrace ? "," : "");
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(fp);
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (is_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i+1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == is_string) is_string = 0;
-        i++;
-        prev_separator = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          is_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
+/*** piece table ***/
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_separator || prev_hl == HL_NUMBER)) || 
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_separator = 0;
-        continue;
-      }
-    }
+// The document is the original file, kept as one read-only buffer, plus an
+// append-only buffer that receives every insertion. The current text is the
+// in-order walk of a treap of pieces, each piece naming a byte range of one
+// of those buffers. Every node also knows the byte and newline totals of its
+// subtree, so finding a line or a byte offset only walks one root-to-leaf path.
 
-    if (prev_separator) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_separator = 0;
-        continue;
-      }
-    }
+size_t ptLen(struct piece *p) { return p ? p->sum_len : 0; }
+size_t ptNl(struct piece *p) { return p ? p->sum_nl : 0; }
 
-    prev_separator = is_separator(c);
-    i++;
-  }
+void ptPull(struct piece *p) {
+  p->sum_len = ptLen(p->left) + p->len + ptLen(p->right);
+  p->sum_nl = ptNl(p->left) + p->nl + ptNl(p->right);
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows) {
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+// Index of the first newline at or after offset off
+size_t ptBufLowerBound(struct ptBuffer *b, size_t off) {
+  size_t lo = 0, hi = b->nlcount;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (b->nl[mid] < off) lo = mid + 1;
+    else hi = mid;
   }
+  return lo;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36;
-    case HL_KEYWORD1: return 33;
-    case HL_KEYWORD2: return 32;
-    case HL_STRING: return 35;
-    case HL_NUMBER: return 31;
-    case HL_MATCH: return 34;
-    default: return 37;
+// ptBufLowerBound() for offsets in ascending order: gallops forward from
+// the previous answer `lo`, so nearby offsets cost a step or two
+size_t ptBufLowerBoundFrom(struct ptBuffer *b, size_t lo, size_t off) {
+  size_t hi = lo, step = 1;
+  while (hi < b->nlcount && b->nl[hi] < off) {
+    lo = hi + 1;
+    hi += step;
+    step *= 2;
   }
+  if (hi > b->nlcount) hi = b->nlcount;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (b->nl[mid] < off) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL) return;
-
-  char *ext = strrchr(E.filename, '.');
+size_t ptBufNewlines(struct ptBuffer *b, size_t off, size_t len) {
+  return ptBufLowerBound(b, off + len) - ptBufLowerBound(b, off);
+}
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+// The newline index grows geometrically; callers reserve room for a whole
+// scan block at once so the inner loops never check capacity
+void ptBufReserveNewlines(struct ptBuffer *b, size_t n) {
+  if (b->nlcount + n <= b->nlcap) return;
+  while (b->nlcount + n > b->nlcap) b->nlcap = b->nlcap ? b->nlcap * 2 : 1024;
+  b->nl = realloc(b->nl, sizeof(size_t) * b->nlcap);
+}
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
-    }
+// Append base + i for every bit i set in mask
+void ptBufAddNewlineMask(struct ptBuffer *b, size_t base, unsigned long long mask) {
+  while (mask) {
+    b->nl[b->nlcount++] = base + __builtin_ctzll(mask);
+    mask &= mask - 1;
   }
 }
 
-/*** Row Operations ***/
-
-// Convert chars index to render index
-// Loop though left of cursor_x to find many space to find correct cursor placement
-int editorRowCursorXToRenderX(editor_row *row, int cursor_x) {
-  int render_x = 0;
-  int j;
-  for (j = 0; j < cursor_x; j++) {
-    if (row->chars[j] == '\t')
-      render_x += (KILO_TAB_STOP - 1) - (render_x % KILO_TAB_STOP);
-    render_x++;
+#ifdef KILO_X86
+// 64 bytes per step: compare against '\n' and turn the result into a bit
+// mask of newline positions, one bit per byte
+__attribute__((target("avx2")))
+size_t ptScanNewlinesAVX2(struct ptBuffer *b, size_t i, size_t to) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; i + 64 <= to; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)&b->b[i]);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)&b->b[i + 32]);
+    unsigned long long mask =
+      (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, nl)) |
+      (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, nl)) << 32;
+    if (mask) {
+      ptBufReserveNewlines(b, 64);
+      ptBufAddNewlineMask(b, i, mask);
+    }
   }
-  return render_x;
+  return i;
 }
 
-int editorRowRxToCx(editor_row *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') 
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
-
-    if (cur_rx > rx) return cx;
+__attribute__((target("sse2")))
+size_t ptScanNewlinesSSE2(struct ptBuffer *b, size_t i, size_t to) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 64 <= to; i += 64) {
+    unsigned long long mask = 0;
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&b->b[i + 16 * k]);
+      mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * k);
+    }
+    if (mask) {
+      ptBufReserveNewlines(b, 64);
+      ptBufAddNewlineMask(b, i, mask);
+    }
   }
-  return cx;
+  return i;
 }
-
-// First loop is find all the tabs in a row
-// allocate memory to fit mulitple white space instead of tab bytes
-// then loop to copy from row->chars to row->render to manipulate tabs size
-void editorUpdateRow(editor_row *row) {
-  int tabs = 0;
-  int j;
-  // Check how many tab there are for accuraty allocate memory with tabs size
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') tabs++;
+#endif
+
+// Record the offset of every '\n' in [from, to)
+void ptBufIndexRange(struct ptBuffer *b, size_t from, size_t to) {
+  size_t i = from;
+#ifdef KILO_X86
+  static int avx2 = -1;
+  if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2");
+  i = avx2 ? ptScanNewlinesAVX2(b, i, to) : ptScanNewlinesSSE2(b, i, to);
+#endif
+  for (; i < to; i++) {
+    if (b->b[i] == '\n') {
+      ptBufReserveNewlines(b, 1);
+      b->nl[b->nlcount++] = i;
+    }
   }
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+void ptBufIndexNewlines(struct ptBuffer *b, size_t from) {
+  ptBufIndexRange(b, from, b->len);
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    // Loop to find the tabs size then replace tab with whitespace
-    // with KILO_TAB_STOP to control how many space tabs have
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+size_t ptBufAppend(struct ptBuffer *b, const char *s, size_t len) {
+  size_t off = b->len;
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+    if (b->pinned) {
+      char *nb = malloc(b->cap);
+      memcpy(nb, b->b, b->len);
+      b->retired = realloc(b->retired, sizeof(char *) * (b->nretired + 1));
+      b->retired[b->nretired++] = b->b;
+      b->b = nb;
     } else {
-      row->render[idx++] = row->chars[j];
+      b->b = realloc(b->b, b->cap);
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  memcpy(&b->b[b->len], s, len);
+  b->len += len;
+  ptBufIndexNewlines(b, off);
+  return off;
+}
 
-  editorUpdateSyntax(row);
+// Bytes already in b stay where they are until ptBufUnpin()
+void ptBufPin(struct ptBuffer *b) {
+  b->pinned = 1;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
+void ptBufUnpin(struct ptBuffer *b) {
+  for (int i = 0; i < b->nretired; i++) free(b->retired[i]);
+  free(b->retired);
+  b->retired = NULL;
+  b->nretired = 0;
+  b->pinned = 0;
+}
 
-  E.row = realloc(E.row, sizeof(editor_row) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(editor_row) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+// Copy a mapped buffer into memory of its own, before the file under it
+// changes. Returns -1 if there isn't the memory.
+int ptBufDetach(struct ptBuffer *b) {
+  if (!b->mapped) return 0;
+  char *copy = malloc(b->len);
+  if (copy == NULL) return -1;
+  memcpy(copy, b->b, b->len);
+  munmap(b->b, b->len);
+  b->b = copy;
+  b->cap = b->len;
+  b->mapped = 0;
+  return 0;
+}
 
-  E.row[at].idx = at;
+struct piece *ptNewPiece(struct pieceTable *pt, int buf, size_t off, size_t len) {
+  struct piece *p = malloc(sizeof(struct piece));
+  // xorshift, priorities only need to be well spread
+  pt->seed ^= pt->seed << 13;
+  pt->seed ^= pt->seed >> 17;
+  pt->seed ^= pt->seed << 5;
+  p->prio = pt->seed;
+  p->left = p->right = NULL;
+  p->buf = buf;
+  p->off = off;
+  p->len = len;
+  p->nl = ptBufNewlines(&pt->bufs[buf], off, len);
+  ptPull(p);
+  return p;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+void ptFreeTree(struct piece *p) {
+  if (p == NULL) return;
+  ptFreeTree(p->left);
+  ptFreeTree(p->right);
+  free(p);
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+struct piece *ptMerge(struct piece *a, struct piece *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->prio > b->prio) {
+    a->right = ptMerge(a->right, b);
+    ptPull(a);
+    return a;
+  }
+  b->left = ptMerge(a, b->left);
+  ptPull(b);
+  return b;
+}
+
+// Split t so that *l holds the first pos bytes and *r the rest. A piece that
+// straddles pos is cut in two.
+void ptSplit(struct pieceTable *pt, struct piece *t, size_t pos,
+             struct piece **l, struct piece **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  size_t llen = ptLen(t->left);
+  if (pos <= llen) {
+    ptSplit(pt, t->left, pos, l, &t->left);
+    ptPull(t);
+    *r = t;
+  } else if (pos >= llen + t->len) {
+    ptSplit(pt, t->right, pos - llen - t->len, &t->right, r);
+    ptPull(t);
+    *l = t;
+  } else {
+    size_t cut = pos - llen;
+    struct piece *tail = ptNewPiece(pt, t->buf, t->off + cut, t->len - cut);
+    // Same priority as t keeps the heap order for t's right subtree
+    tail->prio = t->prio;
+    tail->right = t->right;
+    ptPull(tail);
+    t->right = NULL;
+    t->len = cut;
+    t->nl -= tail->nl;
+    ptPull(t);
+    *l = t;
+    *r = tail;
+  }
+}
+
+// Typing appends to the add buffer right behind the previous insertion, so
+// the last piece of t can usually grow in place instead of adding a node
+int ptExtendLast(struct pieceTable *pt, struct piece *t, int buf, size_t off, size_t len) {
+  struct piece *p = t;
+  if (p == NULL) return 0;
+  while (p->right) p = p->right;
+  if (p->buf != buf || p->off + p->len != off) return 0;
+
+  size_t nl = ptBufNewlines(&pt->bufs[buf], off, len);
+  p->len += len;
+  p->nl += nl;
+  for (p = t; p; p = p->right) {
+    p->sum_len += len;
+    p->sum_nl += nl;
+  }
+  return 1;
+}
+
+// Put bytes that are already in one of the buffers back into the document
+void ptInsertSpan(struct pieceTable *pt, size_t pos, int buf, size_t off, size_t len) {
+  if (len == 0) return;
+  struct piece *l, *r;
+  ptSplit(pt, pt->root, pos, &l, &r);
+  if (!ptExtendLast(pt, l, buf, off, len))
+    l = ptMerge(l, ptNewPiece(pt, buf, off, len));
+  pt->root = ptMerge(l, r);
+}
+
+// Returns where the text went in the add buffer
+size_t ptInsert(struct pieceTable *pt, size_t pos, const char *s, size_t len) {
+  if (len == 0) return pt->bufs[PT_ADD].len;
+  size_t off = ptBufAppend(&pt->bufs[PT_ADD], s, len);
+  ptInsertSpan(pt, pos, PT_ADD, off, len);
+  return off;
+}
+
+// Take len bytes at pos out of the document, as a tree of the pieces that
+// held them
+struct piece *ptCut(struct pieceTable *pt, size_t pos, size_t len) {
+  if (len == 0) return NULL;
+  struct piece *l, *m, *r;
+  ptSplit(pt, pt->root, pos, &l, &m);
+  ptSplit(pt, m, len, &m, &r);
+  pt->root = ptMerge(l, r);
+  return m;
+}
+
+void ptDelete(struct pieceTable *pt, size_t pos, size_t len) {
+  ptFreeTree(ptCut(pt, pos, len));
+}
+
+size_t ptLength(struct pieceTable *pt) { return ptLen(pt->root); }
+size_t ptLines(struct pieceTable *pt) { return ptNl(pt->root); }
+
+// Byte offset where line `line` starts, i.e. just past the line-th newline.
+// Lines past the end map to the end of the document.
+size_t ptLineStart(struct pieceTable *pt, int line) {
+  if (line <= 0) return 0;
+  size_t k = line;
+  size_t base = 0;
+  struct piece *t = pt->root;
+  while (t) {
+    size_t lnl = ptNl(t->left);
+    if (k <= lnl) {
+      t = t->left;
+      continue;
+    }
+    k -= lnl;
+    base += ptLen(t->left);
+    if (k <= t->nl) {
+      struct ptBuffer *b = &pt->bufs[t->buf];
+      size_t first = ptBufLowerBound(b, t->off);
+      return base + (b->nl[first + k - 1] - t->off) + 1;
+    }
+    k -= t->nl;
+    base += t->len;
+    t = t->right;
+  }
+  return base;
+}
+
+// Line holding byte offset pos, i.e. the newlines before it
+int ptLineAt(struct pieceTable *pt, size_t pos) {
+  size_t line = 0;
+  struct piece *t = pt->root;
+  while (t) {
+    size_t llen = ptLen(t->left);
+    if (pos <= llen) {
+      t = t->left;
+      continue;
+    }
+    line += ptNl(t->left);
+    pos -= llen;
+    if (pos <= t->len) return line + ptBufNewlines(&pt->bufs[t->buf], t->off, pos);
+    line += t->nl;
+    pos -= t->len;
+    t = t->right;
+  }
+  return line;
+}
+
+void ptCopyRange(struct pieceTable *pt, struct piece *t, size_t pos,
+                 size_t len, char *dst) {
+  while (t && len > 0) {
+    size_t llen = ptLen(t->left);
+    if (pos < llen) {
+      size_t n = llen - pos;
+      if (n > len) n = len;
+      ptCopyRange(pt, t->left, pos, n, dst);
+      dst += n;
+      len -= n;
+      pos = llen;
+    }
+    size_t in = pos - llen;
+    if (len > 0 && in < t->len) {
+      size_t n = t->len - in;
+      if (n > len) n = len;
+      memcpy(dst, &pt->bufs[t->buf].b[t->off + in], n);
+      dst += n;
+      len -= n;
+      pos += n;
+    }
+    if (len == 0) break;
+    pos -= llen + t->len;
+    t = t->right;
+  }
+}
+
+void ptCopy(struct pieceTable *pt, size_t pos, size_t len, char *dst) {
+  ptCopyRange(pt, pt->root, pos, len, dst);
+}
+
+void ptCollect(struct piece *t, struct piece ***v, size_t *n, size_t *cap) {
+  if (t == NULL) return;
+  ptCollect(t->left, v, n, cap);
+  if (*n == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *v = realloc(*v, sizeof(struct piece *) * *cap);
+  }
+  (*v)[(*n)++] = t;
+  ptCollect(t->right, v, n, cap);
+}
+
+// The pieces in document order, in a malloc()ed array
+struct piece **ptPieces(struct pieceTable *pt, size_t *n) {
+  struct piece **v = NULL;
+  size_t cap = 0;
+  *n = 0;
+  ptCollect(pt->root, &v, n, &cap);
+  return v;
+}
+
+void ptFree(struct pieceTable *pt) {
+  ptFreeTree(pt->root);
+  pt->root = NULL;
+  for (int j = 0; j < 2; j++) {
+    ptBufUnpin(&pt->bufs[j]);
+    if (pt->bufs[j].mapped) munmap(pt->bufs[j].b, pt->bufs[j].len);
+    else free(pt->bufs[j].b);
+    free(pt->bufs[j].nl);
+    memset(&pt->bufs[j], 0, sizeof(struct ptBuffer));
+  }
+}
+
+// Take ownership of buf as the original file contents, either malloc()ed or
+// mapped. Every line in the table ends with '\n', so a missing final newline
+// goes to the add buffer.
+void ptLoad(struct pieceTable *pt, char *buf, size_t len, int mapped) {
+  ptFree(pt);
+  struct ptBuffer *orig = &pt->bufs[PT_ORIG];
+  orig->b = buf;
+  orig->len = orig->cap = len;
+  orig->mapped = mapped;
+  if (mapped) {
+    // Scan a window at a time and hand its pages back to the kernel, so
+    // opening a huge file doesn't leave all of it resident
+    size_t win = 64 << 20;
+    for (size_t off = 0; off < len; off += win) {
+      size_t end = off + win < len ? off + win : len;
+      ptBufIndexRange(orig, off, end);
+      madvise(&buf[off], end - off, MADV_DONTNEED);
+    }
+  } else {
+    ptBufIndexNewlines(orig, 0);
+  }
+  if (len > 0) pt->root = ptNewPiece(pt, PT_ORIG, 0, len);
+  if (len > 0 && buf[len - 1] != '\n') ptInsert(pt, len, "\n", 1);
+}
+
+/*** line states ***/
+
+// One byte of state per line, kept in blocks so that inserting or deleting a
+// line only moves the bytes of one block. Lookups remember the block they
+// landed in, which makes walking consecutive lines O(1).
+
+// Block holding `line` (or ending right at it, when appending) and the index
+// of the line inside it
+int lsLocate(struct lineStates *ls, int line, int *off) {
+  int j = ls->last, first = ls->last_first;
+  if (j >= ls->nblocks || line < first) {
+    j = 0;
+    first = 0;
+  }
+  while (j < ls->nblocks - 1 && line >= first + ls->b[j]->count) {
+    first += ls->b[j]->count;
+    j++;
+  }
+  ls->last = j;
+  ls->last_first = first;
+  *off = line - first;
+  return j;
+}
+
+unsigned char *lsAt(struct lineStates *ls, int line) {
+  int off;
+  int j = lsLocate(ls, line, &off);
+  return &ls->b[j]->s[off];
+}
+
+struct stateBlock *lsNewBlock() {
+  struct stateBlock *blk = malloc(sizeof(struct stateBlock));
+  blk->count = 0;
+  return blk;
+}
+
+void lsInsertBlock(struct lineStates *ls, int at, struct stateBlock *blk) {
+  ls->b = realloc(ls->b, sizeof(struct stateBlock *) * (ls->nblocks + 1));
+  memmove(&ls->b[at + 1], &ls->b[at], sizeof(struct stateBlock *) * (ls->nblocks - at));
+  ls->b[at] = blk;
+  ls->nblocks++;
+}
+
+void lsInsert(struct lineStates *ls, int line, unsigned char v) {
+  if (ls->nblocks == 0) lsInsertBlock(ls, 0, lsNewBlock());
+
+  int off;
+  int j = lsLocate(ls, line, &off);
+  struct stateBlock *blk = ls->b[j];
+  if (blk->count == KILO_STATE_BLOCK) {
+    // Full: move the upper half into a new block after this one
+    struct stateBlock *next = lsNewBlock();
+    next->count = KILO_STATE_BLOCK / 2;
+    memcpy(next->s, &blk->s[KILO_STATE_BLOCK / 2], next->count);
+    blk->count -= next->count;
+    lsInsertBlock(ls, j + 1, next);
+    if (off > blk->count) {
+      off -= blk->count;
+      ls->last_first += blk->count;
+      ls->last = ++j;
+      blk = next;
+    }
+  }
+  memmove(&blk->s[off + 1], &blk->s[off], blk->count - off);
+  blk->s[off] = v;
+  blk->count++;
+}
+
+// Remove n lines from `line` on, a block at a time
+void lsDelete(struct lineStates *ls, int line, int n) {
+  while (n > 0) {
+    int off;
+    int j = lsLocate(ls, line, &off);
+    struct stateBlock *blk = ls->b[j];
+    int k = blk->count - off;
+    if (k > n) k = n;
+    if (k <= 0) break;
+    memmove(&blk->s[off], &blk->s[off + k], blk->count - off - k);
+    blk->count -= k;
+    n -= k;
+    if (blk->count == 0 && ls->nblocks > 1) {
+      free(blk);
+      memmove(&ls->b[j], &ls->b[j + 1], sizeof(struct stateBlock *) * (ls->nblocks - j - 1));
+      ls->nblocks--;
+      ls->last = 0;
+      ls->last_first = 0;
+    }
+  }
+}
+
+// n lines, all zero
+void lsReset(struct lineStates *ls, int n) {
+  for (int j = 0; j < ls->nblocks; j++) free(ls->b[j]);
+  ls->nblocks = (n + KILO_STATE_BLOCK - 1) / KILO_STATE_BLOCK;
+  ls->b = realloc(ls->b, sizeof(struct stateBlock *) * (ls->nblocks + 1));
+  for (int j = 0; j < ls->nblocks; j++) {
+    ls->b[j] = lsNewBlock();
+    ls->b[j]->count = (n - j * KILO_STATE_BLOCK < KILO_STATE_BLOCK) ?
+                      n - j * KILO_STATE_BLOCK : KILO_STATE_BLOCK;
+    memset(ls->b[j]->s, 0, ls->b[j]->count);
+  }
+  ls->last = 0;
+  ls->last_first = 0;
+}
+
+/*** row arena ***/
+
+// Rows come and go with every scroll and their buffers grow a byte at a
+// time while typing, so they don't get memory from malloc() directly.
+// A block is the next power of two up from what was asked for, which makes
+// growing geometric, and freed blocks are reused by their size class.
+// Everything goes back to malloc() at once in arenaRelease().
+
+int arenaClass(size_t n) {
+  if (n <= 16) return 0;
+  return 64 - __builtin_clzll(n - 1) - 4;
+}
+
+// Cut what is left of the current chunk into free blocks
+void arenaSpill(struct rowArena *a) {
+  for (int k = KILO_ARENA_CLASSES - 1; k >= 0; k--) {
+    size_t size = (size_t)16 << k;
+    while (a->bump_left >= size) {
+      *(void **)a->bump = a->free[k];
+      a->free[k] = a->bump;
+      a->bump += size;
+      a->bump_left -= size;
+    }
+  }
+}
+
+// A block of at least n bytes; its actual size goes to *cap
+void *arenaAlloc(struct rowArena *a, size_t n, size_t *cap) {
+  int k = arenaClass(n);
+  size_t size = (size_t)16 << k;
+  a->allocs++;
+  a->used += size;
+  *cap = size;
+
+  if (k >= KILO_ARENA_CLASSES) {
+    struct arenaLarge *b = malloc(sizeof(struct arenaLarge) + size);
+    b->prev = NULL;
+    b->next = a->large;
+    if (a->large) a->large->prev = b;
+    a->large = b;
+    a->mallocs++;
+    a->held += size;
+    return b + 1;
+  }
+
+  if (a->free[k]) {
+    void *p = a->free[k];
+    a->free[k] = *(void **)p;
+    return p;
+  }
+  if (a->bump_left < size) {
+    arenaSpill(a);
+    a->chunks = realloc(a->chunks, sizeof(char *) * (a->nchunks + 1));
+    a->bump = a->chunks[a->nchunks++] = malloc(KILO_ARENA_CHUNK);
+    a->bump_left = KILO_ARENA_CHUNK;
+    a->mallocs++;
+    a->held += KILO_ARENA_CHUNK;
+  }
+  void *p = a->bump;
+  a->bump += size;
+  a->bump_left -= size;
+  return p;
+}
+
+void arenaFree(struct rowArena *a, void *p, size_t cap) {
+  if (p == NULL) return;
+  int k = arenaClass(cap);
+  a->used -= cap;
+  if (k >= KILO_ARENA_CLASSES) {
+    struct arenaLarge *b = (struct arenaLarge *)p - 1;
+    if (b->prev) b->prev->next = b->next;
+    else a->large = b->next;
+    if (b->next) b->next->prev = b->prev;
+    free(b);
+    a->held -= cap;
+    return;
+  }
+  *(void **)p = a->free[k];
+  a->free[k] = p;
+}
+
+// Make the block p of *cap bytes hold at least n, keeping its first `keep`
+// bytes. Most calls find it big enough already.
+void *arenaGrow(struct rowArena *a, void *p, size_t *cap, size_t n, size_t keep) {
+  if (p && n <= *cap) return p;
+  size_t newcap;
+  void *q = arenaAlloc(a, n, &newcap);
+  if (keep) memcpy(q, p, keep);
+  arenaFree(a, p, *cap);
+  *cap = newcap;
+  return q;
+}
+
+// Free every block at once
+void arenaRelease(struct rowArena *a) {
+  for (int j = 0; j < a->nchunks; j++) free(a->chunks[j]);
+  free(a->chunks);
+  while (a->large) {
+    struct arenaLarge *next = a->large->next;
+    free(a->large);
+    a->large = next;
+  }
+  long long allocs = a->allocs, mallocs = a->mallocs;
+  memset(a, 0, sizeof(struct rowArena));
+  a->allocs = allocs;
+  a->mallocs = mallocs;
+}
+
+/*** syntax highlighting ***/
+
+// Forget the highlighting of cached rows from line `from` on
+void editorInvalidateSyntax(int from) {
+  int p = from > E.row_first ? from - E.row_first : 0;
+  for (; p < KILO_ROW_CACHE; p++) {
+    editor_row *row = editorRowSlot(p);
+    row->dirty |= ROW_HL_DIRTY;
+    row->nhlcp = 0;
+  }
+}
+
+void editorInvalidateRow(int at) {
+  editor_row *row = editorRowCached(at);
+  if (row) row->dirty |= ROW_HL_DIRTY;
+}
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// Classify every byte, then build a trie of the keywords with a dense
+// transition table, columns only for bytes that occur in some keyword.
+// Matching a keyword is then one table lookup per byte, however many
+// keywords there are.
+void editorCompileSyntax(struct editorSyntax *s) {
+  struct syntaxTables *t = calloc(1, sizeof(struct syntaxTables));
+  char *delims[] = {
+    s->singleline_comment_start, s->multiline_comment_start,
+    s->multiline_comment_end
+  };
+
+  for (int c = 0; c < 256; c++) {
+    if (is_separator((char)c)) t->cc[c] |= CC_SEPARATOR;
+    if (isdigit(c)) t->cc[c] |= CC_DIGIT;
+    if ((s->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) t->cc[c] |= CC_QUOTE;
+    if (c == ' ' || c == '\t') t->cc[c] |= CC_BLANK;
+  }
+  for (int j = 0; j < 3; j++) {
+    if (delims[j] && delims[j][0]) t->cc[(unsigned char)delims[j][0]] |= CC_COMMENT;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (!(t->cc[c] & (CC_SEPARATOR | CC_QUOTE | CC_COMMENT))) t->cc[c] |= CC_WORD;
+  }
+
+  t->kw_ncls = 1;
+  for (int j = 0; s->keywords[j]; j++) {
+    for (unsigned char *p = (unsigned char *)s->keywords[j]; *p; p++) {
+      if (*p == '|' && p[1] == '\0') break;
+      if (!t->kw_cls[*p]) t->kw_cls[*p] = t->kw_ncls++;
+    }
+  }
+
+  // The vector loops hardwire [0-9A-Za-z_] and bytes >= 0x80 as word bytes,
+  // and space and tab as bytes that do nothing but separate
+  t->skip_ok = !t->kw_cls[' '] && !t->kw_cls['\t'] &&
+               t->cc[' '] == (CC_SEPARATOR | CC_BLANK) &&
+               t->cc['\t'] == (CC_SEPARATOR | CC_BLANK);
+  for (int c = 0; c < 256; c++) {
+    if ((isalnum(c) || c == '_' || c >= 0x80) && !(t->cc[c] & CC_WORD)) t->skip_ok = 0;
+  }
+
+  int nstates = 1, cap = 16;
+  t->kw_next = calloc(cap * t->kw_ncls, sizeof(int));
+  t->kw_accept = calloc(cap, 1);
+  for (int j = 0; s->keywords[j]; j++) {
+    int klen = strlen(s->keywords[j]);
+    int kw2 = s->keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+
+    int st = 0;
+    for (int k = 0; k < klen; k++) {
+      int n = st * t->kw_ncls + t->kw_cls[(unsigned char)s->keywords[j][k]];
+      if (!t->kw_next[n]) {
+        if (nstates == cap) {
+          cap *= 2;
+          t->kw_next = realloc(t->kw_next, cap * t->kw_ncls * sizeof(int));
+          memset(&t->kw_next[nstates * t->kw_ncls], 0,
+                 (cap - nstates) * t->kw_ncls * sizeof(int));
+          t->kw_accept = realloc(t->kw_accept, cap);
+          memset(&t->kw_accept[nstates], 0, cap - nstates);
+        }
+        t->kw_next[n] = nstates++;
+      }
+      st = t->kw_next[n];
+    }
+    // The first listing of a keyword wins, as it used to
+    if (klen && !t->kw_accept[st]) t->kw_accept[st] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  s->tables = t;
+}
+
+// Length of the longest keyword at the start of p that is followed by a
+// separator, 0 if none
+int editorMatchKeyword(struct syntaxTables *t, const char *p, int len, int *hl) {
+  int st = 0, match = 0;
+  for (int k = 0; k < len; k++) {
+    int cls = t->kw_cls[(unsigned char)p[k]];
+    if (!cls || !(st = t->kw_next[st * t->kw_ncls + cls])) break;
+    if (t->kw_accept[st] && (k + 1 == len || (t->cc[(unsigned char)p[k + 1]] & CC_SEPARATOR))) {
+      match = k + 1;
+      *hl = t->kw_accept[st];
+    }
+  }
+  return match;
+}
+
+// Vector helpers for editorHighlightSpan(). Each stops at the first byte it
+// is looking for or when fewer than 16 bytes are left, callers finish off
+// byte by byte.
+#ifdef KILO_X86
+__attribute__((target("sse2")))
+int hlSkipWordSSE2(const char *s, int i, int len) {
+  const __m128i under = _mm_set1_epi8('_');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                _mm_or_si128(_mm_cmpeq_epi8(v, under),
+                                             _mm_cmplt_epi8(v, _mm_setzero_si128())));
+    unsigned int mask = ~_mm_movemask_epi8(word) & 0xffff;
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return i;
+}
+
+__attribute__((target("sse2")))
+int hlSkipBlankSSE2(const char *s, int i, int len) {
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    unsigned int mask = ~_mm_movemask_epi8(blank) & 0xffff;
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return i;
+}
+
+__attribute__((target("sse2")))
+int hlFindSSE2(const char *s, int i, int len, char a, char b) {
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                                       _mm_cmpeq_epi8(v, vb)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return i;
+}
+#endif
+
+// End of the run of word bytes starting at i
+int hlSkipWord(struct syntaxTables *t, const char *s, int i, int len) {
+  for (;;) {
+#ifdef KILO_X86
+    if (t->skip_ok) i = hlSkipWordSSE2(s, i, len);
+#endif
+    if (i >= len || !(t->cc[(unsigned char)s[i]] & CC_WORD)) return i;
+    i++;
+  }
+}
+
+// End of the run of spaces and tabs starting at i
+int hlSkipBlank(struct syntaxTables *t, const char *s, int i, int len) {
+  if (!t->skip_ok) return i;
+#ifdef KILO_X86
+  i = hlSkipBlankSSE2(s, i, len);
+#endif
+  while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+  return i;
+}
+
+// First a or b at or after i, len if neither
+int hlFind(const char *s, int i, int len, char a, char b) {
+#ifdef KILO_X86
+  i = hlFindSSE2(s, i, len, a, b);
+#endif
+  while (i < len && s[i] != a && s[i] != b) i++;
+  return i;
+}
+
+// Colour render[0..rsize), which starts at render column st->rx in state st.
+// The last KILO_HL_LOOKAHEAD columns may come out wrong unless the render
+// reaches the end of the line. With `record`, st is the row's last
+// checkpoint and new ones are added as the span passes them.
+void editorHighlightSpan(editor_row *row, struct hlState *st, int record) {
+  struct syntaxTables *t = E.syntax->tables;
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  if (st->line_comment) {
+    memset(row->hl, HL_COMMENT, row->rsize);
+    return;
+  }
+
+  int in_comment = st->in_comment;
+  int prev_separator = st->prev_separator;
+  int is_string = st->is_string;
+
+  // Checkpoints are only taken where everything before them was decided
+  // with the text that follows it at hand
+  int at_end = row->render_off + row->rsize ==
+               editorRowCursorXToRenderX(row, row->size);
+  int safe = at_end ? row->rsize : row->rsize - KILO_HL_LOOKAHEAD;
+  int next = (st->rx / KILO_HL_CHUNK + 1) * KILO_HL_CHUNK - row->render_off;
+
+  int i = 0;
+  while (i < row->rsize) {
+    int lim = row->rsize;
+    if (record) {
+      if (i >= next && i <= safe) {
+        struct hlState cp = { row->render_off + i, in_comment, is_string,
+                              prev_separator, i > 0 ? row->hl[i - 1] : st->prev_hl, 0 };
+        editorRowAddCheckpoint(row, &cp);
+        next += KILO_HL_CHUNK;
+      }
+      // Bulk skips stop at the next checkpoint
+      if (next > i && next < lim) lim = next;
+    }
+
+    // Skip what can't change anything in bulk: comment bodies, string
+    // bodies, the rest of a word, runs of blanks
+    int from = i;
+    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : st->prev_hl;
+    if (in_comment && mce_len) {
+      i = hlFind(row->render, i, lim, mce[0], mce[0]);
+      memset(&row->hl[from], HL_MLCOMMENT, i - from);
+    } else if (is_string) {
+      i = hlFind(row->render, i, lim, is_string, '\\');
+      memset(&row->hl[from], HL_STRING, i - from);
+      if (i > from) prev_separator = 1;
+    } else {
+      if (!prev_separator && prev_hl != HL_NUMBER)
+        i = hlSkipWord(t, row->render, i, lim);
+      from = i;
+      i = hlSkipBlank(t, row->render, i, lim);
+      if (i > from) prev_separator = 1;
+    }
+    if (i >= lim) continue;
+
+    char c = row->render[i];
+    prev_hl = (i > 0) ? row->hl[i - 1] : st->prev_hl;
+    int cc = t->cc[(unsigned char)c];
+
+    // Comment Highlight
+    if (scs_len && !is_string && !in_comment) {
+      if (!strncmp(&row->render[i], scs, scs_len)) {
+        if (record && i <= safe) {
+          struct hlState cp = { row->render_off + i, 0, 0, 0, prev_hl, 1 };
+          editorRowAddCheckpoint(row, &cp);
+        }
+        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !is_string) {
+      if (in_comment) {
+        row->hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_separator = 1;
+          continue;
+        } else {
+          i++;
+          continue;
+        }
+      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (is_string) {
+        row->hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < row->rsize) {
+          row->hl[i+1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == is_string) is_string = 0;
+        i++;
+        prev_separator = 1;
+        continue;
+      } else {
+        if (cc & CC_QUOTE) {
+          is_string = c;
+          row->hl[i] = HL_STRING;
+          i++;
+          continue;
+        }
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (((cc & CC_DIGIT) && (prev_separator || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        row->hl[i] = HL_NUMBER;
+        i++;
+        prev_separator = 0;
+        continue;
+      }
+    }
+
+    if (prev_separator) {
+      int kw_hl;
+      int klen = editorMatchKeyword(t, &row->render[i], row->rsize - i, &kw_hl);
+      if (klen) {
+        memset(&row->hl[i], kw_hl, klen);
+        i += klen;
+        prev_separator = 0;
+        continue;
+      }
+    }
+
+    prev_separator = cc & CC_SEPARATOR;
+    i++;
+  }
+}
+
+void editorRowAddCheckpoint(editor_row *row, struct hlState *cp) {
+  row->hlcp = arenaGrow(&E.arena, row->hlcp, &row->hlcp_cap,
+                        (row->nhlcp + 1) * sizeof(struct hlState),
+                        row->nhlcp * sizeof(struct hlState));
+  row->hlcp[row->nhlcp++] = *cp;
+}
+
+// Render and colour render columns [from, to) of the row, or a little more
+void editorHighlightWindow(editor_row *row, struct hlState *st, int to, int record) {
+  editorRowRender(row, st->rx, to);
+  E.row_bytes -= row->hl_cap;
+  row->hl = arenaGrow(&E.arena, row->hl, &row->hl_cap, row->rsize, 0);
+  E.row_bytes += row->hl_cap;
+  memset(row->hl, HL_NORMAL, row->rsize);
+  if (E.syntax) editorHighlightSpan(row, st, record);
+}
+
+// The checkpoint to highlight a wide row from so that it is right from
+// render column `from` on. Checkpoints short of `from` are added first, a
+// batch of columns at a time, so later calls start close by.
+int editorRowCheckpoint(editor_row *row, int in_comment, int from, int width) {
+  if (row->nhlcp == 0 || row->hlcp[0].in_comment != in_comment) {
+    struct hlState st = { 0, in_comment, 0, 1, HL_NORMAL, 0 };
+    row->nhlcp = 0;
+    editorRowAddCheckpoint(row, &st);
+  }
+  for (;;) {
+    struct hlState st = row->hlcp[row->nhlcp - 1];
+    if (st.line_comment || st.rx + KILO_HL_CHUNK > from) break;
+    int n = row->nhlcp;
+    int to = st.rx + KILO_HL_BATCH < from ? st.rx + KILO_HL_BATCH : from;
+    to += KILO_HL_LOOKAHEAD;
+    editorHighlightWindow(row, &st, to < width ? to : width, 1);
+    if (row->nhlcp == n) break;
+  }
+
+  int lo = 0, hi = row->nhlcp - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (row->hlcp[mid].rx <= from) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Rows up to KILO_ROW_WINDOW columns wide are rendered and coloured whole.
+// Wider ones only around the view, starting from the closest checkpoint.
+void editorHighlightRow(editor_row *row, int in_comment) {
+  int width = editorRowCursorXToRenderX(row, row->size);
+  struct hlState st = { 0, in_comment, 0, 1, HL_NORMAL, 0 };
+  int to = width, record = 0;
+  row->dirty &= ~ROW_HL_DIRTY;
+
+  if (width > KILO_ROW_WINDOW) {
+    int from = E.col_offset - KILO_ROW_MARGIN;
+    if (from < 0) from = 0;
+    if (from > width) from = width;
+    to = E.col_offset + E.screen_cols + KILO_ROW_MARGIN + KILO_HL_LOOKAHEAD;
+    if (to > width) to = width;
+    if (E.syntax) {
+      int k = editorRowCheckpoint(row, in_comment, from, width);
+      st = row->hlcp[k];
+      record = k == row->nhlcp - 1;
+      if (st.line_comment) st.rx = from;
+    } else {
+      st.rx = from;
+    }
+  }
+  editorHighlightWindow(row, &st, to, record);
+}
+
+// Whether the row's render covers the view, wide rows hold only part of it
+int editorRowCoversView(editor_row *row) {
+  int width = editorRowCursorXToRenderX(row, row->size);
+  if (width <= KILO_ROW_WINDOW) return 1;
+  // Colours in the last KILO_HL_LOOKAHEAD columns may be wrong
+  int end = E.col_offset + E.screen_cols + KILO_HL_LOOKAHEAD;
+  if (end > width) end = width;
+  return row->render_off <= E.col_offset && row->render_off + row->rsize >= end;
+}
+
+// The comment and string rules of editorHighlightSpan(), without colouring
+// anything: whether a line of text ends inside a multi-line comment
+int editorScanComment(const char *s, int len, int in_comment) {
+  struct syntaxTables *t = E.syntax->tables;
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int is_string = 0;
+  int i = 0;
+  while (i < len) {
+    if (in_comment && mce_len) {
+      i = hlFind(s, i, len, mce[0], mce[0]);
+    } else if (is_string) {
+      i = hlFind(s, i, len, is_string, '\\');
+    } else {
+      while (i < len && !(t->cc[(unsigned char)s[i]] & (CC_QUOTE | CC_COMMENT))) i++;
+    }
+    if (i >= len) break;
+
+    if (scs_len && !is_string && !in_comment && !strncmp(&s[i], scs, scs_len))
+      break;
+
+    if (mcs_len && mce_len && !is_string) {
+      if (in_comment) {
+        if (!strncmp(&s[i], mce, mce_len)) {
+          i += mce_len;
+          in_comment = 0;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (!strncmp(&s[i], mcs, mcs_len)) {
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (is_string) {
+        if (s[i] == '\\' && i + 1 < len) {
+          i += 2;
+          continue;
+        }
+        if (s[i] == is_string) is_string = 0;
+        i++;
+        continue;
+      } else if (s[i] == '"' || s[i] == '\'') {
+        is_string = s[i];
+        i++;
+        continue;
+      }
+    }
+    i++;
+  }
+  return in_comment;
+}
+
+int editorScanLine(int at, int in_comment) {
+  int len;
+  char *s = editorLineText(at, &len);
+  return editorScanComment(s, len, in_comment);
+}
+
+// Recompute the end states of lines from `from` on, whose start state must
+// be up to date. Lines below were computed from the old end state of their
+// predecessor, so the walk stops as soon as a line from `settle` on ends up
+// with the state it already had, or at line `limit`; the frontier records
+// what is left.
+void editorSyntaxScan(int from, int settle, int limit) {
+  int in_comment = (from > 0) ? *lsAt(&E.hl, from - 1) : 0;
+  int x;
+  for (x = from; x < E.numrows && x < limit; x++) {
+    unsigned char *st = lsAt(&E.hl, x);
+    int end = editorScanLine(x, in_comment);
+    int same = (x >= settle && x < E.hl_known && *st == end);
+    if (*st != end) {
+      *st = end;
+      editorInvalidateRow(x + 1);
+      if (x + 1 >= E.row_offset && x + 1 < E.row_offset + E.screen_rows) E.hl_stale = 1;
+    }
+    if (x >= E.hl_known) E.hl_known = x + 1;
+    if (same) {
+      if (x + 1 > E.hl_frontier) E.hl_frontier = E.hl_known;
+      return;
+    }
+    in_comment = end;
+  }
+  // The old frontier line was scanned from a state nobody vouched for
+  if (x < E.hl_frontier && E.hl_frontier < E.hl_known) E.hl_known = E.hl_frontier;
+  E.hl_frontier = x;
+}
+
+// Bring the states of lines up to `line` up to date
+void editorSyntaxUpTo(int line) {
+  if (E.syntax == NULL) return;
+  while (E.hl_frontier <= line && E.hl_frontier < E.numrows)
+    editorSyntaxScan(E.hl_frontier, E.hl_frontier, line + 1);
+}
+
+// The n lines from `at` changed, or the successor of line `at` now expects
+// a different end state. Work past them is only done eagerly down to the
+// bottom of the screen.
+void editorSyntaxChanged(int at, int n) {
+  if (E.syntax == NULL) return;
+  if (at < E.hl_frontier) {
+    int limit = E.row_offset + E.screen_rows;
+    editorSyntaxScan(at, at + n - 1, limit > at + n ? limit : at + n);
+  } else if (at > E.hl_frontier && at < E.hl_known) {
+    // Its stored state no longer follows from its predecessor
+    E.hl_known = at;
+  }
+}
+
+// Make room for n new lines at `at`; the caller reports them changed
+void editorSyntaxInsertLines(int at, int n) {
+  // Past the frontier, the line pushed down was scanned from a start state
+  // the copies below need not match
+  if (at < E.hl_frontier) E.hl_frontier += n;
+  if (at < E.hl_known) E.hl_known = (at < E.hl_frontier) ? E.hl_known + n : at;
+  // The line below expected the end state of the line above
+  unsigned char st = (at > 0) ? *lsAt(&E.hl, at - 1) : 0;
+  for (int j = 0; j < n; j++) lsInsert(&E.hl, at, st);
+}
+
+// Lines at..at+n-1 are gone and line at-1 now ends the way the last of
+// them did
+void editorSyntaxDeleteLines(int at, int n) {
+  if (n <= 0) return;
+  unsigned char st = *lsAt(&E.hl, at + n - 1);
+  lsDelete(&E.hl, at, n);
+  if (at < E.hl_frontier) E.hl_frontier -= (E.hl_frontier - at < n) ? E.hl_frontier - at : n;
+  if (at < E.hl_known) E.hl_known -= (E.hl_known - at < n) ? E.hl_known - at : n;
+  if (at > 0) {
+    *lsAt(&E.hl, at - 1) = st;
+    editorSyntaxChanged(at - 1, 1);
+  } else if (E.numrows > 0) {
+    editorSyntaxChanged(0, 1);
+  }
+}
+
+// Finish highlighting the rest of the file a slice at a time while waiting
+// for input, so jumping far ahead doesn't have to
+void editorSyntaxIdle() {
+  if (E.syntax == NULL || E.hl_frontier >= E.numrows) return;
+
+  long long start = perfBegin();
+  do {
+    editorSyntaxScan(E.hl_frontier, E.hl_frontier, E.hl_frontier + 1024);
+  } while (E.hl_frontier < E.numrows && editorClock() - start < KILO_IDLE_NS);
+  perfEnd(PERF_IDLE, start, 0);
+}
+
+void editorUpdateSyntax(editor_row *row) {
+  long long start = perfBegin();
+  int in_comment = 0;
+  if (E.syntax && row->line > 0) {
+    editorSyntaxUpTo(row->line - 1);
+    in_comment = *lsAt(&E.hl, row->line - 1);
+  }
+  editorHighlightRow(row, in_comment);
+  perfEnd(PERF_HIGHLIGHT, start, row->line);
+}
+
+// Highlighting is computed when a row is first drawn, see editorDrawRows(),
+// and again when a wide row scrolls out of what was rendered. A clean row
+// past the frontier may have been highlighted from a state that has changed
+// since, which catching the states up to it finds out.
+void editorRowHighlight(editor_row *row) {
+  if (E.syntax && row->line > 0) editorSyntaxUpTo(row->line - 1);
+  if ((row->dirty & ROW_HL_DIRTY) || !editorRowCoversView(row)) editorUpdateSyntax(row);
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    case HL_MATCH: return 34;
+    default: return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  E.hl_frontier = 0;
+  E.hl_known = 0;
+  editorInvalidateSyntax(0);
+  if (E.filename == NULL) return;
+
+  char *ext = strrchr(E.filename, '.');
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** utf-8 ***/
+
+struct utf8Range {
+  int lo, hi;
+};
+
+// Marks drawn over the character before them, and invisible format
+// characters: no column of their own
+const struct utf8Range utf8_zero[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+  {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+  {0x2028, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F},
+  {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+// East Asian Wide and Fullwidth characters: two columns each
+const struct utf8Range utf8_wide[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+  {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+  {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+  {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+  {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+  {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+  {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+  {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+  {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+  {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+  {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+  {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+  {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int utf8InRanges(const struct utf8Range *r, int n, int cp) {
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (r[mid].hi < cp) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < n && r[lo].lo <= cp;
+}
+
+// Columns a code point takes on the terminal
+int utf8Width(int cp) {
+  if (cp < 0x300) return 1;
+  if (cp >= 0x4E00 && cp <= 0x9FFF) return 2; // the bulk of CJK text
+  if (utf8InRanges(utf8_zero, sizeof(utf8_zero) / sizeof(utf8_zero[0]), cp)) return 0;
+  if (utf8InRanges(utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0]), cp)) return 2;
+  return 1;
+}
+
+// Decode the character at s, of at most len bytes, into *cp and return
+// its length. A byte that starts no valid sequence is one character of
+// its own, with *cp = -1.
+int utf8Decode(const char *s, int len, int *cp) {
+  unsigned char c = s[0];
+  int n, v;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    n = 2;
+    v = c & 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    v = c & 0x0F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    v = c & 0x07;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+  *cp = -1;
+  if (n > len) return 1;
+  for (int i = 1; i < n; i++) {
+    if (((unsigned char)s[i] & 0xC0) != 0x80) return 1;
+    v = (v << 6) | (s[i] & 0x3F);
+  }
+  // Overlong forms, surrogates and code points past U+10FFFF
+  if ((n == 3 && v < 0x800) || (n == 4 && (v < 0x10000 || v > 0x10FFFF)) ||
+      (v >= 0xD800 && v <= 0xDFFF)) return 1;
+  *cp = v;
+  return n;
+}
+
+// Start of the character that ends at s[at]
+int utf8Prev(const char *s, int at) {
+  int p = at - 1, cp;
+  while (p > 0 && at - p < 4 && ((unsigned char)s[p] & 0xC0) == 0x80) p--;
+  if (utf8Decode(&s[p], at - p, &cp) == at - p) return p;
+  return at - 1;
+}
+
+#ifdef KILO_X86
+__attribute__((target("sse2")))
+int utf8SkipAsciiSSE2(const char *s, int i, int len, char stop) {
+  const __m128i vs = _mm_set1_epi8(stop);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, vs)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return i;
+}
+#endif
+
+// End of the run of ASCII bytes other than `stop` starting at i. Pure
+// ASCII text, the common case, goes by 16 bytes at a time.
+int utf8SkipAscii(const char *s, int i, int len, char stop) {
+#ifdef KILO_X86
+  i = utf8SkipAsciiSSE2(s, i, len, stop);
+#endif
+  while (i < len && !((unsigned char)s[i] & 0x80) && s[i] != stop) i++;
+  return i;
+}
+
+/*** Row Operations ***/
+
+// Bring the glyph index of row up to date: every tab and non-ASCII
+// character in chars with the render column that follows it. Runs of plain
+// ASCII between them are skipped a vector at a time and map one to one.
+// Edits only throw away the part from the edited column on, see
+// editorUpdateRow().
+void editorRowGlyphs(editor_row *row) {
+  if (row->glyphs_scanned >= row->size) return;
+  int cx = row->glyphs_scanned, rx = cx;
+  if (row->nglyphs) {
+    struct rowGlyph *last = &row->glyphs[row->nglyphs - 1];
+    rx = last->rx + cx - last->cx - last->len;
+  }
+  for (;;) {
+    int j = utf8SkipAscii(row->chars, cx, row->size, '\t');
+    rx += j - cx;
+    cx = j;
+    if (cx >= row->size) break;
+
+    struct rowGlyph g;
+    g.cx = cx;
+    if (row->chars[cx] == '\t') {
+      g.len = 1;
+      g.width = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+    } else {
+      int cp;
+      g.len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+      g.width = cp < 0 ? 1 : utf8Width(cp);
+    }
+    rx += g.width;
+    g.rx = rx;
+    row->glyphs = arenaGrow(&E.arena, row->glyphs, &row->glyphs_cap,
+                            sizeof(struct rowGlyph) * (row->nglyphs + 1),
+                            sizeof(struct rowGlyph) * row->nglyphs);
+    row->glyphs[row->nglyphs++] = g;
+    cx += g.len;
+  }
+  row->glyphs_scanned = row->size;
+}
+
+// Glyphs in row that start before column cx
+int editorRowGlyphsBefore(editor_row *row, int cx) {
+  int lo = 0, hi = row->nglyphs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (row->glyphs[mid].cx < cx) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Convert chars index to render index: a binary search over the glyphs,
+// the columns between two glyphs map one to one
+int editorRowCursorXToRenderX(editor_row *row, int cursor_x) {
+  editorRowGlyphs(row);
+  int k = editorRowGlyphsBefore(row, cursor_x);
+  if (k == 0) return cursor_x;
+  struct rowGlyph *g = &row->glyphs[k - 1];
+  // Inside a character: where it starts
+  if (cursor_x < g->cx + g->len) return g->rx - g->width;
+  return g->rx + (cursor_x - g->cx - g->len);
+}
+
+// The glyph that render column rx falls in, or the index of the first one
+// after it if it falls between glyphs
+int editorRowGlyphAt(editor_row *row, int rx) {
+  editorRowGlyphs(row);
+  // Glyphs that end at or before rx
+  int lo = 0, hi = row->nglyphs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (row->glyphs[mid].rx <= rx) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int editorRowRxToCx(editor_row *row, int rx) {
+  int k = editorRowGlyphAt(row, rx);
+  int cx = rx;
+  if (k) cx = row->glyphs[k - 1].cx + row->glyphs[k - 1].len + (rx - row->glyphs[k - 1].rx);
+  // Inside the next glyph
+  if (k < row->nglyphs && cx >= row->glyphs[k].cx) return row->glyphs[k].cx;
+  return cx < row->size ? cx : row->size;
+}
+
+// Where the cursor goes from cx on one step right or left: past a whole
+// character, with the combining marks that follow it
+int editorRowNextChar(editor_row *row, int cx) {
+  int cp;
+  cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+  while (cx < row->size) {
+    int len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (cp < 0 || utf8Width(cp) != 0) break;
+    cx += len;
+  }
+  return cx;
+}
+
+int editorRowPrevChar(editor_row *row, int cx) {
+  int cp;
+  do {
+    cx = utf8Prev(row->chars, cx);
+    utf8Decode(&row->chars[cx], row->size - cx, &cp);
+  } while (cx > 0 && cp >= 0 && utf8Width(cp) == 0);
+  return cx;
+}
+
+// Fill render with render columns [from, to) of the row, one byte per
+// column: tabs become the spaces up to the next KILO_TAB_STOP, other glyphs
+// RENDER_GLYPH in each of their columns, see editorDrawGlyph(). The ASCII
+// between glyphs is copied as is.
+void editorRenderRow(editor_row *row, int from, int to) {
+  E.row_bytes -= editorRowBytes(row);
+
+  row->render = arenaGrow(&E.arena, row->render, &row->render_cap,
+                          to - from + 1, 0);
+
+  int k = editorRowGlyphAt(row, from);
+  int cx = editorRowRxToCx(row, from);
+  int rx = editorRowCursorXToRenderX(row, cx);
+  int idx = 0;
+  while (rx < to) {
+    int end = k < row->nglyphs ? row->glyphs[k].cx : row->size;
+    if (cx < end) {
+      // Plain ASCII up to the next glyph
+      int n = end - cx;
+      if (n > to - rx) n = to - rx;
+      memcpy(&row->render[idx], &row->chars[cx], n);
+      idx += n;
+      rx += n;
+      cx += n;
+      continue;
+    }
+    if (k == row->nglyphs) break;
+    struct rowGlyph *g = &row->glyphs[k++];
+    char fill = row->chars[cx] == '\t' ? ' ' : RENDER_GLYPH;
+    // A glyph cut by `from` only gives its tail
+    for (rx = g->rx - g->width; rx < g->rx && rx < to; rx++) {
+      if (rx >= from) row->render[idx++] = fill;
+    }
+    rx = g->rx;
+    cx += g->len;
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  row->render_off = from;
+  row->dirty &= ~ROW_RENDER_DIRTY;
+  E.row_bytes += editorRowBytes(row);
+}
+
+size_t editorRowBytes(editor_row *row) {
+  return row->render_cap + row->hl_cap;
+}
+
+void editorRowDropRender(editor_row *row) {
+  E.row_bytes -= editorRowBytes(row);
+  arenaFree(&E.arena, row->render, row->render_cap);
+  arenaFree(&E.arena, row->hl, row->hl_cap);
+  row->render = NULL;
+  row->hl = NULL;
+  row->render_cap = row->hl_cap = 0;
+  row->rsize = row->render_off = 0;
+  row->dirty |= ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+}
+
+// Offscreen rows give up their render and hl once the cache holds more than
+// KILO_ROW_BUDGET of them; they are rebuilt if they scroll back into view.
+// Rows on screen and `keep` are left alone.
+void editorTrimRows(editor_row *keep) {
+  for (int p = 0; p < KILO_ROW_CACHE && E.row_bytes > KILO_ROW_BUDGET / 2; p++) {
+    editor_row *row = editorRowSlot(p);
+    int line = E.row_first + p;
+    if (row == keep || row->chars == NULL) continue;
+    if (line >= E.row_offset && line < E.row_offset + E.screen_rows) continue;
+    editorRowDropRender(row);
+  }
+}
+
+// Render data is built when a row is drawn or searched, not when it is loaded
+void editorRowRender(editor_row *row, int from, int to) {
+  if (!(row->dirty & ROW_RENDER_DIRTY) && row->render_off == from &&
+      row->rsize == to - from) return;
+  editorRenderRow(row, from, to);
+  if (E.row_bytes > KILO_ROW_BUDGET) editorTrimRows(row);
+}
+
+// Called whenever chars change from column `from` on. The row is rebuilt
+// when it is next drawn, the comment state it hands to the rows below is
+// updated now.
+void editorUpdateRow(editor_row *row, int from) {
+  row->dirty |= ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+  // The edit may have completed or cut a multi-byte character before it
+  for (int n = 0; n < 3 && from > 0 && ((unsigned char)row->chars[from] & 0xC0) == 0x80; n++)
+    from--;
+  row->nglyphs = editorRowGlyphsBefore(row, from);
+  while (row->nglyphs > 0) {
+    struct rowGlyph *last = &row->glyphs[row->nglyphs - 1];
+    if (last->cx + last->len <= from) break;
+    from = last->cx;
+    row->nglyphs--;
+  }
+  if (row->glyphs_scanned > from) row->glyphs_scanned = from;
+
+  // Checkpoints that looked at the edited text go, the render column of
+  // the edit is bounded from below by what the glyph index still knows
+  int cx = row->glyphs_scanned, rx = cx;
+  if (row->nglyphs) {
+    struct rowGlyph *last = &row->glyphs[row->nglyphs - 1];
+    rx = last->rx + cx - last->cx - last->len;
+  }
+  while (row->nhlcp > 0 && row->hlcp[row->nhlcp - 1].rx + KILO_HL_LOOKAHEAD > rx)
+    row->nhlcp--;
+  editorSyntaxChanged(row->line, 1);
+}
+
+// The text of line `at` without materialising a row: the cached row's chars
+// if there is one, else a copy valid until the next call
+char *editorLineText(int at, int *lenp) {
+  static char *buf = NULL;
+  static size_t bufsize = 0;
+
+  editor_row *row = editorRowCached(at);
+  if (row && row->chars) {
+    *lenp = row->size;
+    return row->chars;
+  }
+
+  size_t start = ptLineStart(&E.pt, at);
+  size_t len = ptLineStart(&E.pt, at + 1) - start - 1;
+  if (len + 1 > bufsize) {
+    bufsize = len + 1;
+    buf = realloc(buf, bufsize);
+  }
+  ptCopy(&E.pt, start, len, buf);
+  while (len > 0 && buf[len - 1] == '\r') len--;
+  buf[len] = '\0';
+  *lenp = len;
+  return buf;
+}
+
+// Fill row with line `at` of the piece table. A trailing '\r' stays in the
+// document but is not part of the row.
+void editorRowLoad(editor_row *row, int at) {
+  editorFreeRow(row);
+
+  size_t start = ptLineStart(&E.pt, at);
+  size_t len = ptLineStart(&E.pt, at + 1) - start - 1;
+  row->chars = arenaAlloc(&E.arena, len + 1, &row->chars_cap);
+  ptCopy(&E.pt, start, len, row->chars);
+  while (len > 0 && row->chars[len - 1] == '\r') len--;
+  row->size = len;
+  row->chars[len] = '\0';
+}
+
+// Rows only exist while someone looks at them: they are materialised from
+// the piece table into a window of KILO_ROW_CACHE consecutive lines, and
+// every edit is written through to both. A row's line is its position in
+// the window, so lines coming or going only shift slot numbers around.
+editor_row *editorRowSlot(int pos) {
+  return &E.row[E.row_slot[(E.row_head + pos) & (KILO_ROW_CACHE - 1)]];
+}
+
+// The slot of line `at` if the window covers it, else NULL
+editor_row *editorRowCached(int at) {
+  if (at < E.row_first || at >= E.row_first + KILO_ROW_CACHE) return NULL;
+  return editorRowSlot(at - E.row_first);
+}
+
+// Slide the window to cover line `at`. The rows that fall out are freed
+// and their slots come back in at the other end.
+void editorMoveRows(int at) {
+  int d = (at < E.row_first) ? at - E.row_first : at - (E.row_first + KILO_ROW_CACHE - 1);
+  if (d >= KILO_ROW_CACHE || d <= -KILO_ROW_CACHE) {
+    for (int j = 0; j < KILO_ROW_CACHE; j++) editorFreeRow(&E.row[j]);
+    E.row_first = at > KILO_ROW_CACHE / 2 ? at - KILO_ROW_CACHE / 2 : 0;
+    return;
+  }
+  if (d > 0) {
+    for (int p = 0; p < d; p++) editorFreeRow(editorRowSlot(p));
+  } else {
+    for (int p = KILO_ROW_CACHE + d; p < KILO_ROW_CACHE; p++) editorFreeRow(editorRowSlot(p));
+  }
+  E.row_head = (E.row_head + d) & (KILO_ROW_CACHE - 1);
+  E.row_first += d;
+}
+
+editor_row *editorRowAt(int at) {
+  editor_row *row = editorRowCached(at);
+  if (row == NULL) {
+    editorMoveRows(at);
+    row = editorRowCached(at);
+  }
+  if (row->chars == NULL) editorRowLoad(row, at);
+  row->line = at;
+  return row;
+}
+
+// Move the slots of window positions [from, to) to the end of the window,
+// empty, and everything past them down to `from`
+void editorRowsRemove(int from, int to) {
+  int moved[KILO_ROW_CACHE];
+  int n = to - from;
+  for (int p = from; p < to; p++) {
+    editorFreeRow(editorRowSlot(p));
+    moved[p - from] = E.row_slot[(E.row_head + p) & (KILO_ROW_CACHE - 1)];
+  }
+  for (int p = from; p < KILO_ROW_CACHE - n; p++)
+    E.row_slot[(E.row_head + p) & (KILO_ROW_CACHE - 1)] =
+      E.row_slot[(E.row_head + p + n) & (KILO_ROW_CACHE - 1)];
+  for (int j = 0; j < n; j++)
+    E.row_slot[(E.row_head + KILO_ROW_CACHE - n + j) & (KILO_ROW_CACHE - 1)] = moved[j];
+}
+
+// n > 0 lines were inserted before line `at`, or n < 0 lines deleted from
+// it on; rows below keep their text and only move
+void editorShiftRows(int at, int n) {
+  if (n > 0) {
+    if (at <= E.row_first) {
+      E.row_first += n;
+      return;
+    }
+    int p = at - E.row_first;
+    if (p >= KILO_ROW_CACHE) return;
+    if (n > KILO_ROW_CACHE - p) n = KILO_ROW_CACHE - p;
+    // Empty slots from the end make room, rotated in at p
+    int moved[KILO_ROW_CACHE];
+    for (int j = 0; j < n; j++) {
+      int q = KILO_ROW_CACHE - n + j;
+      editorFreeRow(editorRowSlot(q));
+      moved[j] = E.row_slot[(E.row_head + q) & (KILO_ROW_CACHE - 1)];
+    }
+    for (int q = KILO_ROW_CACHE - 1; q >= p + n; q--)
+      E.row_slot[(E.row_head + q) & (KILO_ROW_CACHE - 1)] =
+        E.row_slot[(E.row_head + q - n) & (KILO_ROW_CACHE - 1)];
+    for (int j = 0; j < n; j++)
+      E.row_slot[(E.row_head + p + j) & (KILO_ROW_CACHE - 1)] = moved[j];
+  } else if (n < 0) {
+    int end = at - n;
+    if (end <= E.row_first) {
+      E.row_first += n;
+      return;
+    }
+    if (at >= E.row_first + KILO_ROW_CACHE) return;
+    int from = at > E.row_first ? at - E.row_first : 0;
+    int to = end - E.row_first < KILO_ROW_CACHE ? end - E.row_first : KILO_ROW_CACHE;
+    if (at < E.row_first) E.row_first = at;
+    editorRowsRemove(from, to);
+  }
+}
+
+// Line `at` changed in place
+void editorDropRow(int at) {
+  editor_row *row = editorRowCached(at);
+  if (row) editorFreeRow(row);
+}
+
+// Byte offset of column `at` of row in the piece table
+size_t editorRowOffset(editor_row *row, int at) {
+  return ptLineStart(&E.pt, row->line) + at;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+
+  size_t pos = ptLineStart(&E.pt, at);
+  editorDocInsert(pos, s, len);
+  editorDocInsert(pos + len, "\n", 1);
+  editorShiftRows(at, 1);
+
+  E.numrows++;
+  editorSyntaxInsertLines(at, 1);
+  editorSyntaxChanged(at, 1);
+  E.dirty++;
+}
+
+void editorFreeRow(editor_row *row) {
+  editorRowDropRender(row);
+  arenaFree(&E.arena, row->chars, row->chars_cap);
+  arenaFree(&E.arena, row->glyphs, row->glyphs_cap);
+  arenaFree(&E.arena, row->hlcp, row->hlcp_cap);
+  row->size = 0;
+  row->chars = NULL;
+  row->glyphs = NULL;
+  row->hlcp = NULL;
+  row->nglyphs = row->glyphs_scanned = row->nhlcp = 0;
+  row->chars_cap = row->glyphs_cap = row->hlcp_cap = 0;
+}
+
+// Forget every cached row at once, handing their memory back in one go
+// unless other buffers have rows in the arena too
+void editorClearRows() {
+  for (int j = 0; j < KILO_ROW_CACHE; j++) {
+    editor_row *row = &E.row[j];
+    if (E.nbuffers > 1) editorFreeRow(row);
+    row->chars = row->render = NULL;
+    row->hl = NULL;
+    row->glyphs = NULL;
+    row->hlcp = NULL;
+    row->nglyphs = row->glyphs_scanned = row->nhlcp = 0;
+    row->chars_cap = row->render_cap = row->hl_cap = row->glyphs_cap = row->hlcp_cap = 0;
+    row->size = row->rsize = row->render_off = 0;
+    row->dirty = ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+    E.row_slot[j] = j;
+  }
+  E.row_head = 0;
+  E.row_first = 0;
+  if (E.nbuffers <= 1) arenaRelease(&E.arena);
+  E.row_bytes = 0;
+}
+
+// How well row memory is used, for KILO_MEMSTATS: the arena's blocks
+// against what it took from malloc(), and row data against the blocks
+void editorMemStats() {
+  struct rowArena *a = &E.arena;
+  size_t data = 0;
+  for (int i = 0; i < E.nbuffers; i++) {
+    editor_row *rows = i == E.buffer ? E.row : E.buffers[i].row;
+    for (int j = 0; j < KILO_ROW_CACHE; j++) {
+      editor_row *row = &rows[j];
+      if (row->chars) data += row->size + 1;
+      if (row->render) data += row->rsize + 1;
+      if (row->hl) data += row->rsize;
+    }
+  }
+  fprintf(stderr, "row memory: %lld blocks, %lld malloc() calls, %zu KB held, "
+          "%d%% of it free, %d%% of blocks in use unfilled\r\n",
+          a->allocs, a->mallocs, a->held >> 10,
+          a->held ? (int)(100 * (a->held - a->used) / a->held) : 0,
+          a->used ? (int)(100 * (a->used - data) / a->used) : 0);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  size_t start = ptLineStart(&E.pt, at);
+  editorDocDelete(start, ptLineStart(&E.pt, at + 1) - start);
+  editorShiftRows(at, -1);
+  E.numrows--;
+  editorSyntaxDeleteLines(at, 1);
+  E.dirty++;
+}
+
+void editorRowInsertChar(editor_row *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  char ch = c;
+  editorDocInsert(editorRowOffset(row, at), &ch, 1);
+  row->chars = arenaGrow(&E.arena, row->chars, &row->chars_cap, row->size + 2, row->size + 1);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row, at);
+  E.dirty++;
+}
+
+void editorRowAppendString(editor_row *row, char *s, size_t len) {
+  int from = row->size;
+  editorDocInsert(editorRowOffset(row, row->size), s, len);
+  row->chars = arenaGrow(&E.arena, row->chars, &row->chars_cap, row->size + len + 1, row->size + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row, from);
+  E.dirty++;
+}
+
+// Delete the len bytes of one character at `at`
+void editorRowDelChar(editor_row *row, int at, int len) {
+  if (at < 0 || at + len > row->size) return;
+  editorDocDelete(editorRowOffset(row, at), len);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row, at);
+  E.dirty++;
+}
+
+/*** Editor Operations ***/
+
+// Insert text, which may hold line breaks, at the cursor as one edit: one
+// piece table insert, and rows below are rebuilt only when next drawn
+void editorInsertText(const char *s, size_t len) {
+  if (len == 0) return;
+  if (E.cursor_y == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editor_row *row = editorRowAt(E.cursor_y);
+  editorDocInsert(editorRowOffset(row, E.cursor_x), s, len);
+
+  int n = 0;
+  const char *last = s; // start of the last line of the text
+  const char *p;
+  while ((p = memchr(last, '\n', s + len - last)) != NULL) {
+    n++;
+    last = p + 1;
+  }
+
+  editorDropRow(E.cursor_y);
+  editorShiftRows(E.cursor_y + 1, n);
+  E.numrows += n;
+  editorSyntaxInsertLines(E.cursor_y + 1, n);
+  editorSyntaxChanged(E.cursor_y, n + 1);
+  E.cursor_x = n ? s + len - last : E.cursor_x + (int)len;
+  E.cursor_y += n;
+  E.dirty++;
+}
+
+void editorInsertChar(int c) {
+  if (E.cursor_y == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRowAt(E.cursor_y), E.cursor_x, c);
+  E.cursor_x++;
+}
+
+void editorInsertNewline() {
+  if (E.cursor_x == 0) {
+    editorInsertRow(E.cursor_y, "", 0);
+  } else {
+    editor_row *row = editorRowAt(E.cursor_y);
+    editorInsertRow(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
+    row = editorRowAt(E.cursor_y);
+    editorDocDelete(editorRowOffset(row, E.cursor_x), row->size - E.cursor_x);
+    row->size = E.cursor_x;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row, E.cursor_x);
+  }
+  E.cursor_y++;
+  E.cursor_x = 0;
+}
+
+void editorDelChar() {
+  if (E.cursor_y == E.numrows) return;
+  if (E.cursor_x == 0 && E.cursor_y == 0) return;
+
+  editor_row *row = editorRowAt(E.cursor_y);
+  if (E.cursor_x > 0) {
+    int at = editorRowPrevChar(row, E.cursor_x);
+    editorRowDelChar(row, at, E.cursor_x - at);
+    E.cursor_x = at;
+  } else {
+    editor_row *prev = editorRowAt(E.cursor_y - 1);
+    E.cursor_x = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cursor_y);
+    E.cursor_y--;
+  }
+}
+
+/*** undo ***/
+
+// Nothing is copied to be undone. Inserted text stays in the add buffer and
+// deleted text in whichever buffer it came from, so a record only holds
+// where the change was and the buffer ranges involved, and undoing a paste
+// of any size is one splice of the piece table.
+
+size_t undoRecordBytes(struct undoRecord *r) {
+  return sizeof(struct undoRecord *) + sizeof(struct undoRecord) +
+         sizeof(struct undoSpan) * r->nspans;
+}
+
+struct undoRecord *undoNewRecord(size_t pos, int insert, int maxspans) {
+  struct undoRecord *r = malloc(sizeof(struct undoRecord) +
+                                sizeof(struct undoSpan) * maxspans);
+  r->pos = pos;
+  r->len = 0;
+  r->insert = insert;
+  r->step = 0;
+  r->nspans = 0;
+  return r;
+}
+
+// Append a span to r, joining it to the last one when they are contiguous
+void undoPushSpan(struct undoRecord *r, int buf, size_t off, size_t len) {
+  struct undoSpan *last = r->nspans ? &r->s[r->nspans - 1] : NULL;
+  if (last && last->buf == buf && last->off + last->len == off) {
+    last->len += len;
+  } else {
+    r->s[r->nspans].buf = buf;
+    r->s[r->nspans].off = off;
+    r->s[r->nspans].len = len;
+    r->nspans++;
+  }
+  r->len += len;
+}
+
+// Forget records from..to-1
+void undoDrop(struct undoLog *u, int from, int to) {
+  if (from == to) return;
+  for (int j = from; j < to; j++) {
+    u->bytes -= undoRecordBytes(u->r[j]);
+    free(u->r[j]);
+  }
+  memmove(&u->r[from], &u->r[to], sizeof(struct undoRecord *) * (u->count - to));
+  u->count -= to - from;
+  if (u->done >= to) u->done -= to - from;
+  else if (u->done > from) u->done = from;
+}
+
+void undoReset(struct undoLog *u) {
+  undoDrop(u, 0, u->count);
+  u->open = 0;
+  u->run = 0;
+}
+
+// Add r as the newest record. What could be redone is gone, and past
+// E.undo_max the oldest steps go until a quarter of it is free again.
+void undoAdd(struct undoLog *u, struct undoRecord *r) {
+  undoDrop(u, u->done, u->count);
+  if (!u->open) {
+    u->step++;
+    u->open = 1;
+  }
+  r->step = u->step;
+  if (u->count == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->r = realloc(u->r, sizeof(struct undoRecord *) * u->cap);
+  }
+  u->r[u->count++] = r;
+  u->done = u->count;
+  u->bytes += undoRecordBytes(r);
+
+  if (u->bytes > E.undo_max) {
+    size_t bytes = u->bytes;
+    int k = 0;
+    while (k < u->count && bytes > E.undo_max / 4 * 3 && u->r[k]->step != u->step) {
+      int step = u->r[k]->step;
+      while (k < u->count && u->r[k]->step == step) bytes -= undoRecordBytes(u->r[k++]);
+    }
+    undoDrop(u, 0, k);
+  }
+}
+
+// The newest record, if the next one may be folded into it
+struct undoRecord *undoOpenRecord(struct undoLog *u) {
+  if (!u->open || u->done == 0 || u->done != u->count) return NULL;
+  return u->r[u->done - 1];
+}
+
+// Insert text into the document, undoably. Typing appends to the add buffer
+// right behind the previous character, so a run of it is a single record.
+void editorDocInsert(size_t pos, const char *s, size_t len) {
+  if (len == 0) return;
+  size_t off = ptInsert(&E.pt, pos, s, len);
+
+  struct undoRecord *r = undoOpenRecord(&E.undo);
+  if (r && r->insert && r->pos + r->len == pos) {
+    struct undoSpan *last = &r->s[r->nspans - 1];
+    if (last->buf == PT_ADD && last->off + last->len == off) {
+      last->len += len;
+      r->len += len;
+      return;
+    }
+  }
+  r = undoNewRecord(pos, 1, 1);
+  undoPushSpan(r, PT_ADD, off, len);
+  undoAdd(&E.undo, r);
+}
+
+// Delete text from the document, undoably. The pieces cut out say where the
+// text lives; a run of backspaces or deletes grows a single record.
+void editorDocDelete(size_t pos, size_t len) {
+  if (len == 0) return;
+  struct piece *cut = ptCut(&E.pt, pos, len);
+  struct piece **v = NULL;
+  size_t n = 0, cap = 0;
+  ptCollect(cut, &v, &n, &cap);
+
+  struct undoRecord *prev = undoOpenRecord(&E.undo);
+  if (prev && (prev->insert || (pos + len != prev->pos && pos != prev->pos)))
+    prev = NULL;
+
+  struct undoRecord *r = undoNewRecord(pos, 0, n + (prev ? prev->nspans : 0));
+  // Deleted in front of the previous deletion, as backspace does
+  if (prev && pos != prev->pos) {
+    for (size_t j = 0; j < n; j++) undoPushSpan(r, v[j]->buf, v[j]->off, v[j]->len);
+    n = 0;
+  }
+  if (prev) {
+    for (int j = 0; j < prev->nspans; j++)
+      undoPushSpan(r, prev->s[j].buf, prev->s[j].off, prev->s[j].len);
+  }
+  for (size_t j = 0; j < n; j++) undoPushSpan(r, v[j]->buf, v[j]->off, v[j]->len);
+  free(v);
+  ptFreeTree(cut);
+
+  if (prev) {
+    // Take prev's place
+    E.undo.bytes -= undoRecordBytes(prev);
+    r->step = prev->step;
+    E.undo.r[E.undo.done - 1] = r;
+    E.undo.bytes += undoRecordBytes(r);
+    free(prev);
+  } else {
+    undoAdd(&E.undo, r);
+  }
+}
+
+// Keys of one kind pressed in a row are undone as one step: a run of
+// typing, of backspaces, or of deletes. Any other key ends the step.
+void editorUndoKey(int c) {
+  int run = 0;
+  if (c == BACKSPACE || c == CRTL_KEY('h')) run = BACKSPACE;
+  else if (c == DEL_KEY) run = DEL_KEY;
+  else if (c == '\t' || (c >= ' ' && c < 256 && c != BACKSPACE)) run = ' ';
+  if (run == 0 || run != E.undo.run) E.undo.open = 0;
+  E.undo.run = run;
+}
+
+// Undo (forward = 0) or redo record r, and bring rows, line count and
+// highlighter up to date. Returns where the text it touched ends.
+size_t editorUndoApply(struct undoRecord *r, int forward) {
+  int line = ptLineAt(&E.pt, r->pos);
+  size_t pos = r->pos;
+
+  if (r->insert == forward) {
+    int n = 0;
+    for (int j = 0; j < r->nspans; j++) {
+      struct undoSpan *sp = &r->s[j];
+      ptInsertSpan(&E.pt, pos, sp->buf, sp->off, sp->len);
+      n += ptBufNewlines(&E.pt.bufs[sp->buf], sp->off, sp->len);
+      pos += sp->len;
+    }
+    if (line == E.numrows) {
+      // At the very end, the text is whole lines
+      editorShiftRows(line, n);
+      E.numrows += n;
+      editorSyntaxInsertLines(line, n);
+      editorSyntaxChanged(line, n);
+    } else {
+      editorDropRow(line);
+      editorShiftRows(line + 1, n);
+      E.numrows += n;
+      editorSyntaxInsertLines(line + 1, n);
+      editorSyntaxChanged(line, n + 1);
+    }
+  } else {
+    int n = ptLineAt(&E.pt, r->pos + r->len) - line;
+    int numrows = E.numrows;
+    ptDelete(&E.pt, r->pos, r->len);
+    E.numrows -= n;
+    if (line + n < numrows) {
+      // Line `line` takes the tail of line line+n
+      editorDropRow(line);
+      editorShiftRows(line + 1, -n);
+      editorSyntaxDeleteLines(line + 1, n);
+      if (n == 0) editorSyntaxChanged(line, 1);
+    } else {
+      editorShiftRows(line, -n);
+      editorSyntaxDeleteLines(line, n);
+    }
+  }
+  return pos;
+}
+
+// Undo or redo the newest step and put the cursor where it happened
+void editorUndo(int forward) {
+  struct undoLog *u = &E.undo;
+  u->open = 0;
+  if (forward ? u->done == u->count : u->done == 0) {
+    editorSetStatusMessage(forward ? "Nothing to redo" : "Nothing to undo");
+    return;
+  }
+
+  size_t at = 0;
+  if (forward) {
+    int step = u->r[u->done]->step;
+    while (u->done < u->count && u->r[u->done]->step == step)
+      at = editorUndoApply(u->r[u->done++], 1);
+  } else {
+    int step = u->r[u->done - 1]->step;
+    at = u->r[u->done - 1]->pos;
+    while (u->done > 0 && u->r[u->done - 1]->step == step) {
+      struct undoRecord *r = u->r[--u->done];
+      editorUndoApply(r, 0);
+      if (r->pos < at) at = r->pos;
+    }
+  }
+
+  E.cursor_y = ptLineAt(&E.pt, at);
+  E.cursor_x = 0;
+  if (E.cursor_y < E.numrows) {
+    editor_row *row = editorRowAt(E.cursor_y);
+    E.cursor_x = at - ptLineStart(&E.pt, E.cursor_y);
+    if (E.cursor_x > row->size) E.cursor_x = row->size;
+  }
+  E.dirty++;
+}
+
+/*** File I/O ***/
+
+// Make the file behind fd the original buffer of the piece table. Regular
+// files are mapped rather than read: only the newline index is built up
+// front, and pages are faulted in as rows get materialised from them.
+int editorLoadFile(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) return -1;
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      ptLoad(&E.pt, map, st.st_size, 1);
+      madvise(map, st.st_size, MADV_NORMAL);
+      E.pt.bufs[PT_ORIG].dev = st.st_dev;
+      E.pt.bufs[PT_ORIG].ino = st.st_ino;
+      return 0;
+    }
+  }
+
+  // Empty files and anything mmap() refuses get read instead
+  lseek(fd, 0, SEEK_SET);
+  size_t len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  ssize_t nread;
+  while ((nread = read(fd, &buf[len], cap - len)) > 0) {
+    len += nread;
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  if (nread == -1) {
+    free(buf);
+    return -1;
+  }
+  ptLoad(&E.pt, buf, len, 0);
+  return 0;
+}
+
+// Load filename into the current buffer. Only regular files are; on error
+// the buffer is left as it was and errno says why.
+int editorOpen(char *filename) {
+  long long start = perfBegin();
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  int ok = fstat(fd, &st) == 0;
+  if (ok && !S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    ok = 0;
+  }
+  if (!ok) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  // A save of this buffer still reads the text about to be replaced
+  if (E.save.active && E.save.buffer == E.buffer) editorSaveWait();
+  editorClearRows();
+  if (editorLoadFile(fd) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  close(fd);
+
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntaxHighlight();
+
+  E.numrows = ptLines(&E.pt);
+  undoReset(&E.undo);
+  lsReset(&E.hl, E.numrows);
+  E.hl_frontier = 0;
+  E.hl_known = 0;
+  E.dirty = 0;
+  perfEnd(PERF_LOAD, start, E.numrows);
+  return 0;
+}
+
+// The document as the byte ranges of the buffers it is made of, in order
+struct saveSpan *editorSaveSpans(int *nspans, size_t *total) {
+  size_t n;
+  struct piece **v = ptPieces(&E.pt, &n);
+  struct saveSpan *s = malloc(sizeof(struct saveSpan) * (n ? n : 1));
+  *total = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct ptBuffer *b = &E.pt.bufs[v[i]->buf];
+    s[i].p = &b->b[v[i]->off];
+    s[i].len = v[i]->len;
+    s[i].mapped = b->mapped;
+    *total += v[i]->len;
+  }
+  *nspans = n;
+  free(v);
+  return s;
+}
+
+// Write all of iov[0..n) to fd, however many calls that takes
+int editorWritev(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
 
-  E.numrows++;
-  E.dirty++;
+// Stream the spans to fd straight from the buffers, in batches of up to
+// KILO_SAVE_IOV iovecs and KILO_SAVE_BATCH bytes. Pages of a mapped file
+// are let go once written, so saving doesn't pull the whole file in.
+int editorWriteSpans(int fd, struct saveSpan *s, int n, size_t *progress) {
+  struct iovec iov[KILO_SAVE_IOV];
+  struct iovec drop[KILO_SAVE_IOV]; // the mapped ones, as editorWritev() moves iov
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  int i = 0;
+  size_t off = 0; // into s[i]
+  while (i < n) {
+    int niov = 0, ndrop = 0;
+    size_t batch = 0;
+    while (i < n && niov < KILO_SAVE_IOV && batch < KILO_SAVE_BATCH) {
+      size_t len = s[i].len - off;
+      if (len > KILO_SAVE_BATCH - batch) len = KILO_SAVE_BATCH - batch;
+      iov[niov].iov_base = (char *)s[i].p + off;
+      iov[niov].iov_len = len;
+      if (s[i].mapped) drop[ndrop++] = iov[niov];
+      niov++;
+      batch += len;
+      off += len;
+      if (off == s[i].len) {
+        i++;
+        off = 0;
+      }
+    }
+    if (editorWritev(fd, iov, niov) == -1) return -1;
+    __sync_fetch_and_add(progress, batch);
+    for (int k = 0; k < ndrop; k++) {
+      uintptr_t a = (uintptr_t)drop[k].iov_base;
+      madvise((void *)(a & ~(page - 1)), drop[k].iov_len + (a & (page - 1)), MADV_DONTNEED);
+    }
+  }
+  return 0;
 }
 
-void editorFreeRow(editor_row *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// A new file beside path for a save to go to, its name in *tmp. -1 if the
+// directory won't take one.
+int editorTempFile(const char *path, char **tmp) {
+  *tmp = malloc(strlen(path) + 16);
+  sprintf(*tmp, "%s.kilo-XXXXXX", path);
+  int fd = -1;
+  if (E.bench.no_temp) errno = EACCES; // see benchCommand(), `save inplace`
+  else fd = mkstemp(*tmp);
+  if (fd == -1) {
+    free(*tmp);
+    *tmp = NULL;
+  }
+  return fd;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(editor_row) * (E.numrows - at -1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[at].idx--;
-  E.numrows--;
-  E.dirty++;
+// Whether st is the file source is a mapping of
+int editorIsSource(struct stat *st, const struct ptBuffer *source) {
+  return source->mapped && st->st_dev == source->dev && st->st_ino == source->ino;
 }
 
-void editorRowInsertChar(editor_row *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Whether saving to filename would have to overwrite the file the original
+// text is mapped from, for want of a temp file beside it
+int editorSaveOverSource(const char *filename) {
+  char *path = realpath(filename, NULL);
+  if (!path) return 0;
+  struct stat st;
+  int over = stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+             editorIsSource(&st, &E.pt.bufs[PT_ORIG]);
+  if (over) {
+    char *tmp;
+    int fd = editorTempFile(path, &tmp);
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+      free(tmp);
+      over = 0;
+    }
+  }
+  free(path);
+  return over;
 }
 
-void editorRowAppendString(editor_row *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len +1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+int editorWriteInPlace(const char *path, struct saveSpan *s, int n, size_t *progress) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return -1;
+  int ok = editorWriteSpans(fd, s, n, progress) == 0;
+  if (ok && fsync(fd) == -1 && errno != EINVAL) ok = 0; // EINVAL: can't sync this
+  int saved_errno = errno;
+  if (close(fd) == -1 && ok) return -1;
+  errno = saved_errno;
+  return ok ? 0 : -1;
 }
 
-void editorRowDelChar(editor_row *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// Write the spans to a new file beside the old one, make sure it is on
+// disk, and only then rename it over the old one: a crash or a full disk
+// midway leaves the old file as it was. The piece table may go on reading
+// from a mapping of the old file, which lives on unlinked until unmapped.
+// New files, devices, FIFOs and files in directories we can't write to are
+// written in place instead, but never the file source is mapped from:
+// truncating it would take the text being written with it. Bytes written
+// so far are added up in *progress.
+int editorWriteFile(const char *filename, struct saveSpan *s, int n, size_t *progress,
+                    const struct ptBuffer *source) {
+  // Through a symlink, replace what it points to rather than the link
+  char *path = realpath(filename, NULL);
+  if (!path) path = strdup(filename);
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  if (!exists || !S_ISREG(st.st_mode)) {
+    int r = editorWriteInPlace(path, s, n, progress);
+    free(path);
+    return r;
+  }
+
+  char *tmp;
+  int fd = editorTempFile(path, &tmp);
+  if (fd == -1) {
+    int r = -1;
+    if (!editorIsSource(&st, source)) r = editorWriteInPlace(path, s, n, progress);
+    free(path);
+    return r;
+  }
+  fchmod(fd, st.st_mode & 07777);
+  fchown(fd, st.st_uid, st.st_gid); // fails unless we own the group too, or are root
+
+  int ok = editorWriteSpans(fd, s, n, progress) == 0 && fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  ok = ok && rename(tmp, path) == 0;
+  int saved_errno = errno;
+  if (ok) {
+    // Make the rename itself durable
+    char *slash = strrchr(path, '/');
+    if (slash == path) slash++; // the root directory
+    if (slash) *slash = '\0';
+    int dfd = open(slash ? path : ".", O_RDONLY);
+    if (dfd != -1) {
+      fsync(dfd);
+      close(dfd);
+    }
+  } else {
+    unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+  errno = saved_errno;
+  return ok ? 0 : -1;
 }
 
-/*** Editor Operations ***/
+void *editorSaveThread(void *arg) {
+  struct saveState *sv = arg;
+  sv->result = editorWriteFile(sv->filename, sv->spans, sv->nspans, &sv->written, &sv->source);
+  sv->error = errno;
+  write(sv->pipe[1], "", 1);
+  return NULL;
+}
 
-void editorInsertChar(int c) {
-  if (E.cursor_y == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// Wrap up a save once its thread has said it's done
+void editorSaveFinish() {
+  struct saveState *sv = &E.save;
+  char c;
+  read(sv->pipe[0], &c, 1);
+  pthread_join(sv->thread, NULL);
+  close(sv->pipe[0]);
+  close(sv->pipe[1]);
+  // The buffer may have been switched away from meanwhile
+  struct pieceTable *pt = sv->buffer == E.buffer ? &E.pt : &E.buffers[sv->buffer].pt;
+  ptBufUnpin(&pt->bufs[PT_ADD]);
+  sv->active = 0;
+
+  if (sv->result == 0) {
+    // Edits made while saving aren't on disk
+    int *dirty = editorBufferDirty(sv->buffer);
+    if (*dirty == sv->dirty) *dirty = 0;
+    editorSetStatusMessage("%zu bytes written to disk", sv->total);
+  } else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(sv->error));
   }
-  editorRowInsertChar(&E.row[E.cursor_y], E.cursor_x, c);
-  E.cursor_x++;
+  free(sv->spans);
+  free(sv->filename);
 }
 
-void editorInsertNewline() {
-  if (E.cursor_x == 0) {
-    editorInsertRow(E.cursor_y, "", 0);
+// Block until the save in progress, if any, is done
+void editorSaveWait() {
+  if (!E.save.active) return;
+  struct pollfd fd = { E.save.pipe[0], POLLIN, 0 };
+  while (poll(&fd, 1, -1) == -1 && errno == EINTR) {}
+  editorSaveFinish();
+}
+
+// Save on a thread of its own, so typing goes on meanwhile. What gets
+// written is a snapshot: the list of byte ranges the document is made of
+// right now. Edits after it never touch those bytes, as the original is
+// read-only and the add buffer only grows, and while pinned, grows into a
+// new block rather than moving the old one.
+void editorSave() {
+  struct saveState *sv = &E.save;
+  if (sv->active) {
+    editorSetStatusMessage("Still saving, try again when done");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  // Written in place, the file would be truncated under the text
+  if (editorSaveOverSource(E.filename) && ptBufDetach(&E.pt.bufs[PT_ORIG]) == -1) {
+    editorSetStatusMessage("Can't save! No memory to copy the file before overwriting it");
+    return;
+  }
+
+  sv->spans = editorSaveSpans(&sv->nspans, &sv->total);
+  sv->filename = strdup(E.filename);
+  sv->source = E.pt.bufs[PT_ORIG];
+  sv->buffer = E.buffer;
+  sv->written = 0;
+  sv->dirty = E.dirty;
+  if (pipe(sv->pipe) == -1) die("pipe");
+  ptBufPin(&E.pt.bufs[PT_ADD]);
+  sv->active = 1;
+  if (pthread_create(&sv->thread, NULL, editorSaveThread, sv) != 0) {
+    sv->active = 0;
+    ptBufUnpin(&E.pt.bufs[PT_ADD]);
+    close(sv->pipe[0]);
+    close(sv->pipe[1]);
+    editorSetStatusMessage("Can't save! %s", strerror(errno));
+    free(sv->spans);
+    free(sv->filename);
+  }
+}
+
+/*** buffers ***/
+
+// Every open file keeps its rows, highlighting and undo history while
+// another one is shown, so switching back costs a copy of its struct
+// editorBuffer and nothing more. The row arena, the syntax tables, the
+// screen grids and the input are the editor's, not any one buffer's.
+
+void editorBufferStash(struct editorBuffer *b) {
+  b->cursor_x = E.cursor_x;
+  b->cursor_y = E.cursor_y;
+  b->render_x = E.render_x;
+  b->row_offset = E.row_offset;
+  b->col_offset = E.col_offset;
+  b->numrows = E.numrows;
+  b->row = E.row;
+  b->row_slot = E.row_slot;
+  b->row_head = E.row_head;
+  b->row_first = E.row_first;
+  b->row_bytes = E.row_bytes;
+  b->pt = E.pt;
+  b->hl = E.hl;
+  b->hl_frontier = E.hl_frontier;
+  b->hl_known = E.hl_known;
+  b->dirty = E.dirty;
+  b->filename = E.filename;
+  b->syntax = E.syntax;
+  b->undo = E.undo;
+}
+
+void editorBufferRestore(struct editorBuffer *b) {
+  E.cursor_x = b->cursor_x;
+  E.cursor_y = b->cursor_y;
+  E.render_x = b->render_x;
+  E.row_offset = b->row_offset;
+  E.col_offset = b->col_offset;
+  E.numrows = b->numrows;
+  E.row = b->row;
+  E.row_slot = b->row_slot;
+  E.row_head = b->row_head;
+  E.row_first = b->row_first;
+  E.row_bytes = b->row_bytes;
+  E.pt = b->pt;
+  E.hl = b->hl;
+  E.hl_frontier = b->hl_frontier;
+  E.hl_known = b->hl_known;
+  E.dirty = b->dirty;
+  E.filename = b->filename;
+  E.syntax = b->syntax;
+  E.undo = b->undo;
+}
+
+// An empty, unnamed document in E
+void editorBufferInit() {
+  E.cursor_x = 0;
+  E.cursor_y = 0;
+  E.render_x = 0;
+  E.numrows = 0;
+  E.row_offset = 0;
+  E.col_offset = 0;
+  E.row = calloc(KILO_ROW_CACHE, sizeof(editor_row));
+  E.row_slot = malloc(sizeof(int) * KILO_ROW_CACHE);
+  for (int j = 0; j < KILO_ROW_CACHE; j++) E.row_slot[j] = j;
+  E.row_head = 0;
+  E.row_first = 0;
+  E.row_bytes = 0;
+  memset(&E.pt, 0, sizeof(E.pt));
+  memset(&E.hl, 0, sizeof(E.hl));
+  E.hl_frontier = 0;
+  E.hl_known = 0;
+  E.pt.seed = 2463534242u;
+  E.dirty = 0;
+  E.filename = NULL;
+  E.syntax = NULL;
+  memset(&E.undo, 0, sizeof(E.undo));
+}
+
+// The dirty count of buffer i, wherever it is kept
+int *editorBufferDirty(int i) {
+  return i == E.buffer ? &E.dirty : &E.buffers[i].dirty;
+}
+
+int editorAnyDirty() {
+  for (int i = 0; i < E.nbuffers; i++)
+    if (*editorBufferDirty(i)) return 1;
+  return 0;
+}
+
+void editorSwitchBuffer(int to) {
+  if (to == E.buffer || to < 0 || to >= E.nbuffers) return;
+  editorBufferStash(&E.buffers[E.buffer]);
+  editorBufferRestore(&E.buffers[to]);
+  E.buffer = to;
+  editorSetStatusMessage("Buffer %d/%d: %s", to + 1, E.nbuffers,
+                         E.filename ? E.filename : "[No name]");
+}
+
+// Make a new empty buffer the current one
+void editorNewBuffer() {
+  E.buffers = realloc(E.buffers, sizeof(struct editorBuffer) * (E.nbuffers + 1));
+  editorBufferStash(&E.buffers[E.buffer]);
+  E.buffer = E.nbuffers++;
+  editorBufferInit();
+}
+
+// Throw away the empty buffer editorNewBuffer() just made and go back to
+// buffer `to`
+void editorDropBuffer(int to) {
+  free(E.row);
+  free(E.row_slot);
+  E.nbuffers--;
+  E.buffer = to;
+  editorBufferRestore(&E.buffers[to]);
+}
+
+// Show filename, from the buffer that has it open if there is one. A name
+// that doesn't exist yet makes an empty buffer that saves to it.
+void editorOpenBuffer(char *filename) {
+  for (int i = 0; i < E.nbuffers; i++) {
+    char *name = i == E.buffer ? E.filename : E.buffers[i].filename;
+    if (name && !strcmp(name, filename)) {
+      editorSwitchBuffer(i);
+      return;
+    }
+  }
+
+  struct stat st;
+  int exists = stat(filename, &st) == 0;
+  if (!exists && errno != ENOENT) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
+  if (exists && !S_ISREG(st.st_mode)) {
+    editorSetStatusMessage("Can't open %s: %s", filename,
+                           S_ISDIR(st.st_mode) ? strerror(EISDIR) : "not a regular file");
+    return;
+  }
+
+  // The buffer an editor starts with, while still untouched, is reused
+  int from = E.buffer, fresh = E.filename || E.dirty || E.numrows;
+  if (fresh) editorNewBuffer();
+  if (!exists) {
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+    editorSetStatusMessage("New file: %s", filename);
+  } else if (editorOpen(filename) == -1) {
+    int err = errno;
+    if (fresh) editorDropBuffer(from);
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(err));
+  }
+}
+
+void editorOpenPrompt() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (filename == NULL) return;
+  editorOpenBuffer(filename);
+  free(filename);
+}
+
+// Pick a buffer by its number, from a list of them in the prompt
+void editorBufferList() {
+  char list[256];
+  int len = snprintf(list, sizeof(list), "Buffer");
+  for (int i = 0; i < E.nbuffers && len < (int)sizeof(list) - 16; i++) {
+    char *name = i == E.buffer ? E.filename : E.buffers[i].filename;
+    len += snprintf(&list[len], sizeof(list) - len, " %d:%s%s", i + 1,
+                    *editorBufferDirty(i) ? "+" : "", name ? name : "[No name]");
+  }
+  if (len > (int)sizeof(list) - 16) len = sizeof(list) - 16;
+
+  // The prompt is a format, names mustn't add conversions to it
+  char prompt[sizeof(list) * 2 + 8];
+  int k = 0;
+  for (int i = 0; i < len; i++) {
+    if (list[i] == '%') prompt[k++] = '%';
+    prompt[k++] = list[i];
+  }
+  memcpy(&prompt[k], ": %s", 5);
+
+  char *answer = editorPrompt(prompt, NULL);
+  if (answer == NULL) return;
+  int to = atoi(answer) - 1;
+  free(answer);
+  if (to < 0 || to >= E.nbuffers) editorSetStatusMessage("No such buffer");
+  else editorSwitchBuffer(to);
+}
+
+/*** regex ***/
+
+// Regular expressions for find. A pattern becomes a Thompson NFA, twice
+// over: once as written and once reversed. Each is run as a DFA built
+// lazily, a state at a time, as the text asks for it. Matching is per
+// line and leftmost-longest:
+//   - a backward pass over the line marks every column where a match
+//     starts;
+//   - a forward pass from the leftmost mark takes the longest match there.
+// Both passes look at each byte once, so no pattern can make the search
+// backtrack.
+//
+// Syntax: literals, . [abc] [^a-z] \d \w \s \D \W \S \t, \ to escape,
+// ^ $ (...) | and * + ? {m} {m,} {m,n}.
+
+enum reNodeType { RE_EMPTY, RE_SET, RE_BOL, RE_EOL, RE_CAT, RE_ALT, RE_REPEAT };
+
+struct reNode {
+  int type;
+  struct reNode *a, *b;
+  int min, max; // RE_REPEAT; max is -1 for no limit
+  unsigned char set[32]; // RE_SET, a bit per byte
+};
+
+// A NFA state. RE_OP_START and RE_OP_END are zero-width: they match the
+// line boundary where the scan begins, or where it ends (^ and $ going
+// forward, the other way round going backward).
+enum reOp { RE_OP_SET, RE_OP_SPLIT, RE_OP_START, RE_OP_END, RE_OP_MATCH };
+
+struct reState {
+  int op;
+  int out, out1; // next state; out1 for RE_OP_SPLIT only
+  int set; // RE_OP_SET, index in regex.sets
+};
+
+struct regex {
+  struct reState *states;
+  int nstates, cap;
+  unsigned char (*sets)[32];
+  int nsets;
+  int fstart, rstart; // entries of the forward and the backward NFA
+  unsigned char cls[256]; // byte -> class of the bytes no set tells apart
+  unsigned char rep[256]; // class -> a byte of it
+  int ncls;
+  char **lits; // strings every match contains, longest first
+  int *lit_len;
+  int nlits;
+  const char *error;
+};
+
+// A DFA state is a set of NFA states. Its transitions live in one table,
+// a row per state and a column per symbol, the symbols being the byte
+// classes then the start and the end of the scan. States are named by
+// where their row starts, so a step is one load.
+#define RE_MATCH 1
+#define RE_DEAD 2
+
+struct reDState {
+  int *set; // sorted
+  int n;
+};
+
+struct reDFA {
+  struct regex *re;
+  int entry; // NFA state the DFA starts from
+  int unanchored; // a match may begin at any byte, not only the first
+  int sym_start, sym_end;
+  int shift; // state i has row i << shift
+  struct reDState *s;
+  int ns, cap;
+  int *trans; // next state's row by row + symbol, -1 until needed
+  unsigned char *flags; // RE_MATCH and RE_DEAD by state
+  int *hash; // indices into s, -1 for none; open addressing
+  int start; // row of the entry state, -1 until needed
+  int *mark, gen; // scratch, by NFA state
+  int *stack, *buf;
+};
+
+// The per-thread half of a search: the DFAs fill in as they run
+struct reMatcher {
+  struct reDFA fwd; // anchored at the match start, left to right
+  struct reDFA rev; // unanchored, right to left
+  unsigned char *starts; // by column, whether a match starts there
+  int cap;
+};
+
+struct reParser {
+  const char *p;
+  const char *error;
+  int depth;
+};
+
+struct reNode *reNewNode(int type) {
+  struct reNode *n = calloc(1, sizeof(struct reNode));
+  n->type = type;
+  return n;
+}
+
+void reFreeNode(struct reNode *n) {
+  if (!n) return;
+  reFreeNode(n->a);
+  reFreeNode(n->b);
+  free(n);
+}
+
+void reSetRange(unsigned char *set, int lo, int hi) {
+  for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+// \d \w \s and their complements; returns 0 for any other letter
+int reSetClass(unsigned char *set, int c) {
+  unsigned char s[32] = {0};
+  switch (tolower(c)) {
+    case 'd': reSetRange(s, '0', '9'); break;
+    case 'w': reSetRange(s, '0', '9'); reSetRange(s, 'a', 'z');
+              reSetRange(s, 'A', 'Z'); reSetRange(s, '_', '_'); break;
+    case 's': reSetRange(s, '\t', '\r'); reSetRange(s, ' ', ' '); break;
+    default: return 0;
+  }
+  for (int i = 0; i < 32; i++) set[i] |= isupper(c) ? ~s[i] : s[i];
+  return 1;
+}
+
+int reEscape(int c) {
+  return c == 't' ? '\t' : c;
+}
+
+struct reNode *reParseAlt(struct reParser *ps);
+
+struct reNode *reParseClass(struct reParser *ps) {
+  struct reNode *n = reNewNode(RE_SET);
+  int negate = 0;
+  if (*ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first)) {
+    int lo = (unsigned char)*ps->p++;
+    first = 0;
+    if (lo == '\\' && *ps->p) {
+      if (reSetClass(n->set, *ps->p)) {
+        ps->p++;
+        continue;
+      }
+      lo = reEscape((unsigned char)*ps->p++);
+    }
+    int hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      ps->p++;
+      hi = (unsigned char)*ps->p++;
+      if (hi == '\\' && *ps->p) hi = reEscape((unsigned char)*ps->p++);
+      if (hi < lo) {
+        ps->error = "bad range";
+        return n;
+      }
+    }
+    reSetRange(n->set, lo, hi);
+  }
+  if (*ps->p != ']') {
+    ps->error = "missing ]";
+    return n;
+  }
+  ps->p++;
+  if (negate)
+    for (int i = 0; i < 32; i++) n->set[i] = ~n->set[i];
+  return n;
+}
+
+struct reNode *reParseAtom(struct reParser *ps) {
+  struct reNode *n;
+  int c = (unsigned char)*ps->p++;
+  switch (c) {
+    case '(':
+      if (++ps->depth > KILO_RE_DEPTH) {
+        ps->error = "nested too deep";
+        return reNewNode(RE_EMPTY);
+      }
+      n = reParseAlt(ps);
+      ps->depth--;
+      if (!ps->error && *ps->p != ')') ps->error = "missing )";
+      if (!ps->error) ps->p++;
+      return n;
+    case '[':
+      return reParseClass(ps);
+    case '.':
+      n = reNewNode(RE_SET);
+      reSetRange(n->set, 0, 255);
+      return n;
+    case '^':
+      return reNewNode(RE_BOL);
+    case '$':
+      return reNewNode(RE_EOL);
+    case '*': case '+': case '?':
+      ps->error = "nothing to repeat";
+      return reNewNode(RE_EMPTY);
+    case '\\':
+      n = reNewNode(RE_SET);
+      if (!*ps->p) {
+        ps->error = "trailing \\";
+        return n;
+      }
+      c = (unsigned char)*ps->p++;
+      if (!reSetClass(n->set, c)) reSetRange(n->set, reEscape(c), reEscape(c));
+      return n;
+    default:
+      n = reNewNode(RE_SET);
+      reSetRange(n->set, c, c);
+      return n;
+  }
+}
+
+// {m}, {m,} or {m,n} at ps->p. Anything else is left to be a literal '{'.
+int reParseCount(struct reParser *ps, int *min, int *max) {
+  const char *p = ps->p + 1;
+  if (!isdigit((unsigned char)*p)) return 0;
+  *min = 0;
+  while (isdigit((unsigned char)*p) && *min <= KILO_RE_REPEAT) *min = *min * 10 + (*p++ - '0');
+  *max = *min;
+  if (*p == ',') {
+    p++;
+    *max = -1;
+    if (isdigit((unsigned char)*p)) {
+      *max = 0;
+      while (isdigit((unsigned char)*p) && *max <= KILO_RE_REPEAT) *max = *max * 10 + (*p++ - '0');
+    }
+  }
+  if (*p != '}') return 0;
+  if (*min > KILO_RE_REPEAT || *max > KILO_RE_REPEAT) ps->error = "repeat too large";
+  else if (*max != -1 && *max < *min) ps->error = "bad repeat";
+  ps->p = p + 1;
+  return 1;
+}
+
+struct reNode *reParseRepeat(struct reParser *ps) {
+  struct reNode *n = reParseAtom(ps);
+  while (!ps->error) {
+    int min = 0, max = -1;
+    if (*ps->p == '*') {
+      ps->p++;
+    } else if (*ps->p == '+') {
+      min = 1;
+      ps->p++;
+    } else if (*ps->p == '?') {
+      max = 1;
+      ps->p++;
+    } else if (*ps->p != '{' || !reParseCount(ps, &min, &max)) {
+      break;
+    }
+    struct reNode *r = reNewNode(RE_REPEAT);
+    r->a = n;
+    r->min = min;
+    r->max = max;
+    n = r;
+  }
+  return n;
+}
+
+struct reNode *reParseCat(struct reParser *ps) {
+  struct reNode *n = NULL;
+  while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    struct reNode *a = reParseRepeat(ps);
+    if (n) {
+      struct reNode *c = reNewNode(RE_CAT);
+      c->a = n;
+      c->b = a;
+      a = c;
+    }
+    n = a;
+  }
+  return n ? n : reNewNode(RE_EMPTY);
+}
+
+struct reNode *reParseAlt(struct reParser *ps) {
+  struct reNode *n = reParseCat(ps);
+  while (!ps->error && *ps->p == '|') {
+    ps->p++;
+    struct reNode *a = reNewNode(RE_ALT);
+    a->a = n;
+    a->b = reParseCat(ps);
+    n = a;
+  }
+  return n;
+}
+
+int reAddState(struct regex *re, int op, int out, int out1, int set) {
+  if (re->nstates == KILO_RE_STATES) {
+    re->error = "pattern too large";
+    return 0;
+  }
+  if (re->nstates == re->cap) {
+    re->cap = re->cap ? re->cap * 2 : 64;
+    re->states = realloc(re->states, sizeof(struct reState) * re->cap);
+  }
+  struct reState *st = &re->states[re->nstates];
+  st->op = op;
+  st->out = out;
+  st->out1 = out1;
+  st->set = set;
+  return re->nstates++;
+}
+
+int reAddSet(struct regex *re, const unsigned char *set) {
+  for (int i = 0; i < re->nsets; i++)
+    if (!memcmp(re->sets[i], set, 32)) return i;
+  re->sets = realloc(re->sets, sizeof(*re->sets) * (re->nsets + 1));
+  memcpy(re->sets[re->nsets], set, 32);
+  return re->nsets++;
+}
+
+// Build node n so that it carries on to state `next`, and return the state
+// it begins with. Built backwards like this, a concatenation only has to
+// swap its halves to run right to left.
+int reEmit(struct regex *re, struct reNode *n, int next, int reverse) {
+  if (re->error) return 0;
+  switch (n->type) {
+    case RE_EMPTY:
+      return next;
+    case RE_SET:
+      return reAddState(re, RE_OP_SET, next, 0, reAddSet(re, n->set));
+    case RE_BOL:
+      return reAddState(re, reverse ? RE_OP_END : RE_OP_START, next, 0, 0);
+    case RE_EOL:
+      return reAddState(re, reverse ? RE_OP_START : RE_OP_END, next, 0, 0);
+    case RE_CAT:
+      if (reverse) return reEmit(re, n->b, reEmit(re, n->a, next, 1), 1);
+      return reEmit(re, n->a, reEmit(re, n->b, next, 0), 0);
+    case RE_ALT:
+      return reAddState(re, RE_OP_SPLIT, reEmit(re, n->a, next, reverse),
+                        reEmit(re, n->b, next, reverse), 0);
+    case RE_REPEAT: {
+      int cur = next;
+      if (n->max == -1) {
+        int loop = reAddState(re, RE_OP_SPLIT, 0, next, 0);
+        int body = reEmit(re, n->a, loop, reverse);
+        if (!re->error) re->states[loop].out = body;
+        cur = loop;
+      } else {
+        for (int i = n->min; i < n->max; i++)
+          cur = reAddState(re, RE_OP_SPLIT, reEmit(re, n->a, cur, reverse), next, 0);
+      }
+      for (int i = 0; i < n->min; i++) cur = reEmit(re, n->a, cur, reverse);
+      return cur;
+    }
+  }
+  return next;
+}
+
+// Bytes that every set takes or leaves alike share a class, so the DFA
+// needs a transition per class rather than per byte
+void reClasses(struct regex *re) {
+  memset(re->cls, 0, sizeof(re->cls));
+  re->ncls = 1;
+  for (int k = 0; k < re->nsets; k++) {
+    short id[256][2];
+    memset(id, -1, sizeof(id));
+    int ncls = 0;
+    for (int c = 0; c < 256; c++) {
+      int in = (re->sets[k][c >> 3] >> (c & 7)) & 1;
+      if (id[re->cls[c]][in] == -1) id[re->cls[c]][in] = ncls++;
+      re->cls[c] = id[re->cls[c]][in];
+    }
+    re->ncls = ncls;
+  }
+  for (int c = 255; c >= 0; c--) re->rep[re->cls[c]] = c;
+}
+
+int reSingleByte(const unsigned char *set) {
+  int c = -1;
+  for (int i = 0; i < 256; i++) {
+    if (!((set[i >> 3] >> (i & 7)) & 1)) continue;
+    if (c != -1) return -1;
+    c = i;
+  }
+  return c;
+}
+
+void reAddLiteral(struct regex *re, const char *run, int len) {
+  if (len == 0) return;
+  re->lits = realloc(re->lits, sizeof(char *) * (re->nlits + 1));
+  re->lit_len = realloc(re->lit_len, sizeof(int) * (re->nlits + 1));
+  int i = re->nlits++;
+  for (; i > 0 && re->lit_len[i - 1] < len; i--) {
+    re->lits[i] = re->lits[i - 1];
+    re->lit_len[i] = re->lit_len[i - 1];
+  }
+  re->lits[i] = malloc(len);
+  memcpy(re->lits[i], run, len);
+  re->lit_len[i] = len;
+}
+
+// Whether s holds each of the pattern's literals from the `from`th on;
+// a line that doesn't can't match
+int reHasLiterals(struct regex *re, const char *s, int len, int from) {
+  for (int i = from; i < re->nlits; i++)
+    if (!findMemmem(s, len, re->lits[i], re->lit_len[i])) return 0;
+  return 1;
+}
+
+// Walk the concatenation at the top of the pattern for runs of bytes that
+// must match one after another, into re->lits. The search looks for the
+// longest first, and only runs the DFAs on lines that have them all.
+void reLiteral(struct regex *re, struct reNode *n, char *run, int *len) {
+  int c;
+  switch (n->type) {
+    case RE_EMPTY: case RE_BOL: case RE_EOL:
+      return;
+    case RE_CAT:
+      reLiteral(re, n->a, run, len);
+      reLiteral(re, n->b, run, len);
+      return;
+    case RE_SET:
+      if ((c = reSingleByte(n->set)) != -1) {
+        run[(*len)++] = c;
+        return;
+      }
+      break;
+    case RE_REPEAT:
+      if (n->min > 0 && n->a->type == RE_SET && (c = reSingleByte(n->a->set)) != -1)
+        run[(*len)++] = c;
+      break;
+  }
+  reAddLiteral(re, run, *len);
+  *len = 0;
+}
+
+void reFree(struct regex *re) {
+  if (!re) return;
+  free(re->states);
+  free(re->sets);
+  for (int i = 0; i < re->nlits; i++) free(re->lits[i]);
+  free(re->lits);
+  free(re->lit_len);
+  free(re);
+}
+
+// Compile pattern, or return NULL with the reason in *error
+struct regex *reCompile(const char *pattern, const char **error) {
+  if (strlen(pattern) > KILO_RE_LENGTH) {
+    *error = "pattern too long";
+    return NULL;
+  }
+  struct reParser ps = {pattern, NULL, 0};
+  struct reNode *root = reParseAlt(&ps);
+  if (!ps.error && *ps.p) ps.error = "unmatched )";
+  if (ps.error) {
+    reFreeNode(root);
+    *error = ps.error;
+    return NULL;
+  }
+
+  struct regex *re = calloc(1, sizeof(struct regex));
+  int match = reAddState(re, RE_OP_MATCH, 0, 0, 0);
+  re->fstart = reEmit(re, root, match, 0);
+  re->rstart = reEmit(re, root, match, 1);
+  reClasses(re);
+
+  size_t plen = strlen(pattern);
+  char *run = malloc(plen + 1);
+  int len = 0;
+  reLiteral(re, root, run, &len);
+  reAddLiteral(re, run, len);
+  free(run);
+  reFreeNode(root);
+
+  if (re->error) {
+    *error = re->error;
+    reFree(re);
+    return NULL;
+  }
+  return re;
+}
+
+void reDFAInit(struct reDFA *d, struct regex *re, int entry, int unanchored) {
+  memset(d, 0, sizeof(*d));
+  d->re = re;
+  d->entry = entry;
+  d->unanchored = unanchored;
+  d->sym_start = re->ncls;
+  d->sym_end = re->ncls + 1;
+  while ((1 << d->shift) < re->ncls + 2) d->shift++;
+  d->hash = malloc(sizeof(int) * KILO_RE_HASH);
+  memset(d->hash, -1, sizeof(int) * KILO_RE_HASH);
+  d->start = -1;
+  d->mark = calloc(re->nstates, sizeof(int));
+  d->stack = malloc(sizeof(int) * re->nstates);
+  d->buf = malloc(sizeof(int) * re->nstates);
+}
+
+// Drop every state; they are rebuilt as the scan needs them again
+void reDFAFlush(struct reDFA *d) {
+  for (int i = 0; i < d->ns; i++) free(d->s[i].set);
+  d->ns = 0;
+  memset(d->hash, -1, sizeof(int) * KILO_RE_HASH);
+  d->start = -1;
+}
+
+void reDFAFree(struct reDFA *d) {
+  reDFAFlush(d);
+  free(d->s);
+  free(d->trans);
+  free(d->flags);
+  free(d->hash);
+  free(d->mark);
+  free(d->stack);
+  free(d->buf);
+}
+
+// Add s, and every state it reaches without consuming anything, to
+// d->buf[0..*n); d->mark keeps out the ones already there
+void reClosure(struct reDFA *d, int s, int *n) {
+  int top = 0;
+  d->stack[top++] = s;
+  while (top) {
+    s = d->stack[--top];
+    if (d->mark[s] == d->gen) continue;
+    d->mark[s] = d->gen;
+    struct reState *st = &d->re->states[s];
+    if (st->op == RE_OP_SPLIT) {
+      d->stack[top++] = st->out1;
+      d->stack[top++] = st->out;
+    } else {
+      d->buf[(*n)++] = s;
+    }
+  }
+}
+
+int reCompareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+unsigned int reHashSet(const int *set, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+  return h;
+}
+
+// The row of the state for the set in d->buf[0..n), made if new
+int reDFAIntern(struct reDFA *d, int n) {
+  qsort(d->buf, n, sizeof(int), reCompareInt);
+  unsigned int h = reHashSet(d->buf, n) & (KILO_RE_HASH - 1);
+  for (; d->hash[h] != -1; h = (h + 1) & (KILO_RE_HASH - 1)) {
+    struct reDState *ds = &d->s[d->hash[h]];
+    if (ds->n == n && !memcmp(ds->set, d->buf, sizeof(int) * n)) return d->hash[h] << d->shift;
+  }
+  if (d->ns == KILO_RE_DSTATES) {
+    reDFAFlush(d);
+    return reDFAIntern(d, n);
+  }
+
+  if (d->ns == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 64;
+    d->s = realloc(d->s, sizeof(struct reDState) * d->cap);
+    d->trans = realloc(d->trans, sizeof(int) * ((size_t)d->cap << d->shift));
+    d->flags = realloc(d->flags, d->cap);
+  }
+  struct reDState *ds = &d->s[d->ns];
+  ds->set = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(ds->set, d->buf, sizeof(int) * n);
+  ds->n = n;
+  d->flags[d->ns] = n ? 0 : RE_DEAD;
+  for (int i = 0; i < n; i++)
+    if (d->re->states[d->buf[i]].op == RE_OP_MATCH) d->flags[d->ns] |= RE_MATCH;
+  int row = d->ns << d->shift;
+  for (int i = 0; i < (1 << d->shift); i++) d->trans[row + i] = -1;
+  d->hash[h] = d->ns++;
+  return row;
+}
+
+int reDFAStart(struct reDFA *d) {
+  if (d->start == -1) {
+    int n = 0;
+    d->gen++;
+    reClosure(d, d->entry, &n);
+    d->start = reDFAIntern(d, n);
+  }
+  return d->start;
+}
+
+// Where the state at `row` goes on symbol sym, worked out from the NFA.
+// The start and end of the scan are zero-width: every state stays, plus
+// the ones that get past a ^ or $.
+int reDFAStep(struct reDFA *d, int row, int sym) {
+  struct reDState *ds = &d->s[row >> d->shift];
+  int n = 0;
+  d->gen++;
+  if (sym == d->sym_start || sym == d->sym_end) {
+    int op = (sym == d->sym_start) ? RE_OP_START : RE_OP_END;
+    for (int i = 0; i < ds->n; i++) {
+      d->mark[ds->set[i]] = d->gen;
+      d->buf[n++] = ds->set[i];
+    }
+    for (int i = 0; i < n; i++) {
+      struct reState *st = &d->re->states[d->buf[i]];
+      if (st->op == op) reClosure(d, st->out, &n);
+    }
   } else {
-    editor_row *row = &E.row[E.cursor_y];
-    editorInsertRow(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
-    row = &E.row[E.cursor_y];
-    row->size = E.cursor_x;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    int c = d->re->rep[sym];
+    for (int i = 0; i < ds->n; i++) {
+      struct reState *st = &d->re->states[ds->set[i]];
+      if (st->op == RE_OP_SET && (d->re->sets[st->set][c >> 3] >> (c & 7)) & 1)
+        reClosure(d, st->out, &n);
+    }
+    if (d->unanchored) reClosure(d, d->entry, &n);
+  }
+  int ns = d->ns;
+  int to = reDFAIntern(d, n);
+  if (d->ns >= ns) d->trans[row + sym] = to; // unless flushed meanwhile
+  return to;
+}
+
+int reDFANext(struct reDFA *d, int row, int sym) {
+  int to = d->trans[row + sym];
+  return to >= 0 ? to : reDFAStep(d, row, sym);
+}
+
+void reMatcherInit(struct reMatcher *m, struct regex *re) {
+  reDFAInit(&m->fwd, re, re->fstart, 0);
+  reDFAInit(&m->rev, re, re->rstart, 1);
+  m->starts = NULL;
+  m->cap = 0;
+}
+
+void reMatcherFree(struct reMatcher *m) {
+  reDFAFree(&m->fwd);
+  reDFAFree(&m->rev);
+  free(m->starts);
+}
+
+// Mark in m->starts each column of s where a match starts, by running the
+// reversed pattern from the end of the line back to its start. Returns
+// whether there is any.
+int reMarkStarts(struct reMatcher *m, const char *s, int len) {
+  struct reDFA *d = &m->rev;
+  const unsigned char *cls = d->re->cls;
+  if (len + 1 > m->cap) {
+    m->cap = len + 1;
+    m->starts = realloc(m->starts, m->cap);
+  }
+  int any = 0;
+  int cur = reDFANext(d, reDFAStart(d), d->sym_start);
+  // Kept in locals, as the stores to starts could alias anything
+  unsigned char *starts = m->starts;
+  const int *trans = d->trans;
+  const unsigned char *flags = d->flags;
+  int shift = d->shift;
+  starts[len] = 0; // only an empty match could start there
+  for (int i = len - 1; i >= 0; i--) {
+    int sym = cls[(unsigned char)s[i]];
+    int next = trans[cur + sym];
+    if (next < 0) {
+      next = reDFAStep(d, cur, sym);
+      trans = d->trans;
+      flags = d->flags;
+    }
+    cur = next;
+    unsigned char match = flags[cur >> shift] & RE_MATCH;
+    starts[i] = match;
+    any |= match;
+  }
+  if (len > 0 && !m->starts[0]) {
+    cur = reDFANext(d, cur, d->sym_end);
+    m->starts[0] = d->flags[cur >> d->shift] & RE_MATCH;
+    any |= m->starts[0];
   }
-  E.cursor_y++;
-  E.cursor_x = 0;
+  return any;
 }
 
-void editorDelChar() {
-  if (E.cursor_y == E.numrows) return;
-  if (E.cursor_x == 0 && E.cursor_y == 0) return;
+// The end of the longest match that starts at column `at`, or -1
+int reLongest(struct reMatcher *m, const char *s, int len, int at) {
+  struct reDFA *d = &m->fwd;
+  const unsigned char *cls = d->re->cls;
+  int cur = reDFAStart(d), end = -1;
+  if (at == 0) cur = reDFANext(d, cur, d->sym_start);
+  if (d->flags[cur >> d->shift] & RE_MATCH) end = at;
+  for (int i = at; i < len; i++) {
+    int sym = cls[(unsigned char)s[i]];
+    int next = d->trans[cur + sym];
+    cur = next >= 0 ? next : reDFAStep(d, cur, sym);
+    unsigned char f = d->flags[cur >> d->shift];
+    if (f & RE_DEAD) return end;
+    if (f & RE_MATCH) end = i + 1;
+  }
+  cur = reDFANext(d, cur, d->sym_end);
+  if (d->flags[cur >> d->shift] & RE_MATCH) end = len;
+  return end;
+}
 
-  editor_row *row = &E.row[E.cursor_y];
-  if (E.cursor_x > 0) {
-    editorRowDelChar(row, E.cursor_x - 1);
-    E.cursor_x--;
-  } else {
-    E.cursor_x = E.row[E.cursor_y - 1].size;
-    editorRowAppendString(&E.row[E.cursor_y - 1], row->chars, row->size);
-    editorDelRow(E.cursor_y);
-    E.cursor_y--;
+// The next match that isn't empty, starting at column `from` or after: its
+// start, with its end in *end, or -1. Needs reMarkStarts() on s first.
+int reNext(struct reMatcher *m, const char *s, int len, int from, int *end) {
+  while (from < len) {
+    unsigned char *p = memchr(&m->starts[from], 1, len - from);
+    if (!p) return -1;
+    int at = p - m->starts;
+    int e = reLongest(m, s, len, at);
+    if (e > at) {
+      *end = e;
+      return at;
+    }
+    from = at + 1;
   }
+  return -1;
 }
 
-/*** File I/O ***/
+/*** find ***/
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// Substring search kernels: compare the first and the last byte of the
+// needle against a whole vector of positions at once, and memcmp() only
+// where both agree. The needle is at least 2 bytes.
+#ifdef KILO_X86
+__attribute__((target("avx2")))
+const char *findMemmemAVX2(const char *h, size_t hlen, const char *n, size_t nlen) {
+  const __m256i first = _mm256_set1_epi8(n[0]);
+  const __m256i last = _mm256_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 32 <= hlen; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)&h[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)&h[i + nlen - 1]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(&h[i + bit + 1], n + 1, nlen - 2)) return &h[i + bit];
+      mask &= mask - 1;
+    }
   }
+  return memmem(&h[i], hlen - i, n, nlen);
+}
 
-  return buf;
+__attribute__((target("sse2")))
+const char *findMemmemSSE2(const char *h, size_t hlen, const char *n, size_t nlen) {
+  const __m128i first = _mm_set1_epi8(n[0]);
+  const __m128i last = _mm_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&h[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&h[i + nlen - 1]);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(&h[i + bit + 1], n + 1, nlen - 2)) return &h[i + bit];
+      mask &= mask - 1;
+    }
+  }
+  return memmem(&h[i], hlen - i, n, nlen);
+}
+#endif
+
+const char *findMemmem(const char *h, size_t hlen, const char *n, size_t nlen) {
+#ifdef KILO_X86
+  static int avx2 = -1;
+  if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2");
+#endif
+  if (nlen == 0 || nlen > hlen) return NULL;
+  if (nlen == 1) return memchr(h, n[0], hlen);
+#ifdef KILO_X86
+  return avx2 ? findMemmemAVX2(h, hlen, n, nlen) : findMemmemSSE2(h, hlen, n, nlen);
+#else
+  return memmem(h, hlen, n, nlen);
+#endif
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+void findAdd(struct findState *f, int line, int col, int len) {
+  f->total++;
+  if (f->count == KILO_FIND_MAX) return;
+  if (f->count == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->m = realloc(f->m, sizeof(struct findMatch) * f->cap);
+  }
+  f->m[f->count].line = line;
+  f->m[f->count].col = col;
+  f->m[f->count].len = len;
+  f->count++;
+}
 
-  editorSelectSyntaxHighlight();
+// Matches don't overlap: the search resumes after the end of each one
+void findInLine(struct findState *f, int line) {
+  int len;
+  char *s = editorLineText(line, &len);
+  if (f->re) {
+    if (!reHasLiterals(f->re, s, len, 0) || !reMarkStarts(f->rm, s, len)) return;
+    int at = 0, end;
+    while ((at = reNext(f->rm, s, len, at, &end)) != -1) {
+      findAdd(f, line, at, end - at);
+      at = end;
+    }
+    return;
+  }
+  size_t qlen = strlen(f->query);
+  const char *p = s, *m;
+  while ((m = findMemmem(p, s + len - p, f->query, qlen)) != NULL) {
+    findAdd(f, line, m - s, qlen);
+    p = m + qlen;
+  }
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+// A stretch of whole lines inside one buffer, searched by one worker.
+// A job with no bytes stands for a line that spans pieces, which is
+// searched on the main thread once the workers are done.
+struct findJob {
+  struct ptBuffer *b;
+  size_t off, len;
+  size_t first; // index in b->nl of the first newline in the stretch
+  int line; // document line the stretch starts on
+  int lines;
+  struct findMatch *m;
+  int count, cap;
+  long long total; // count falls short of it once the shared room ran out
+};
 
-  char *line = NULL;
-  size_t line_cap = 0;
-  ssize_t line_length;
+struct findWork {
+  const char *query;
+  size_t qlen;
+  struct regex *re; // query compiled, if regex
+  struct findJob *jobs;
+  int njobs;
+  int next; // next job to claim
+  pthread_mutex_t lock; // guards room
+  int room; // matches jobs may still store between them
+};
 
-  line_length = getline(&line, &line_cap, fp); // will return -1 if it the end of the file
+// All jobs together store at most KILO_FIND_MAX matches, past that they
+// only count them. A job takes room as its array grows.
+void findJobAdd(struct findWork *w, struct findJob *j, int line, int col, int len) {
+  j->total++;
+  if (j->count < j->total - 1) return; // one was left out, the room is gone
+  if (j->count == j->cap) {
+    pthread_mutex_lock(&w->lock);
+    int grow = j->cap ? j->cap : 64;
+    if (grow > w->room) grow = w->room;
+    w->room -= grow;
+    pthread_mutex_unlock(&w->lock);
+    if (grow == 0) return;
+    j->cap += grow;
+    j->m = realloc(j->m, sizeof(struct findMatch) * j->cap);
+  }
+  j->m[j->count].line = line;
+  j->m[j->count].col = col;
+  j->m[j->count].len = len;
+  j->count++;
+}
 
-  while ((line_length = getline(&line, &line_cap, fp)) != -1) {
-    while(line_length > 0 && (line[line_length - 1] == '\n' || 
-                              line[line_length - 1] == '\r'))
-      line_length--;
-    editorInsertRow(E.numrows, line, line_length);
+void findRunJob(struct findWork *w, struct findJob *j) {
+  struct ptBuffer *b = j->b;
+  const char *p = &b->b[j->off], *stop = p + j->len, *m;
+  size_t nl = j->first;
+  while ((m = findMemmem(p, stop - p, w->query, w->qlen)) != NULL) {
+    size_t at = m - b->b;
+    nl = ptBufLowerBoundFrom(b, nl, at);
+    size_t bol = (nl > j->first) ? b->nl[nl - 1] + 1 : j->off;
+    findJobAdd(w, j, j->line + (nl - j->first), at - bol, w->qlen);
+    p = m + w->qlen;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Lines are handed to the matcher one by one: all of them, or when the
+// pattern holds literals, only those they all turn up in
+void findRunRegexJob(struct findWork *w, struct findJob *j, struct reMatcher *rm) {
+  struct ptBuffer *b = j->b;
+  struct regex *re = w->re;
+  size_t at = j->off, stop = j->off + j->len;
+  size_t nl = j->first;
+  while (at < stop) {
+    if (re->nlits) {
+      const char *m = findMemmem(&b->b[at], stop - at, re->lits[0], re->lit_len[0]);
+      if (!m) break;
+      nl = ptBufLowerBoundFrom(b, nl, m - b->b);
     }
-    editorSelectSyntaxHighlight();
+    size_t bol = (nl > j->first) ? b->nl[nl - 1] + 1 : j->off;
+    int len = b->nl[nl] - bol;
+    const char *s = &b->b[bol];
+    while (len > 0 && s[len - 1] == '\r') len--;
+    if (reHasLiterals(re, s, len, 1) && reMarkStarts(rm, s, len)) {
+      int col = 0, end;
+      while ((col = reNext(rm, s, len, col, &end)) != -1) {
+        findJobAdd(w, j, j->line + (nl - j->first), col, end - col);
+        col = end;
+      }
+    }
+    at = b->nl[nl++] + 1;
+  }
+}
+
+// Jobs are claimed in document order
+void *findWorker(void *arg) {
+  struct findWork *w = arg;
+  struct reMatcher rm;
+  int i;
+  if (w->re) reMatcherInit(&rm, w->re);
+  while ((i = __sync_fetch_and_add(&w->next, 1)) < w->njobs) {
+    if (!w->jobs[i].len) continue;
+    if (w->re) findRunRegexJob(w, &w->jobs[i], &rm);
+    else findRunJob(w, &w->jobs[i]);
   }
+  if (w->re) reMatcherFree(&rm);
+  return NULL;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) != -1) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+void findAddJob(struct findJob **v, int *n, int *cap, struct ptBuffer *b,
+                size_t off, size_t len, size_t first, int line, int lines) {
+  if (*n == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *v = realloc(*v, sizeof(struct findJob) * *cap);
+  }
+  struct findJob *j = &(*v)[(*n)++];
+  memset(j, 0, sizeof(*j));
+  j->b = b;
+  j->off = off;
+  j->len = len;
+  j->first = first;
+  j->line = line;
+  j->lines = lines;
+}
+
+// Search the whole document straight out of the buffers. A query never
+// holds a newline, so the lines that lie wholly inside a piece can be
+// searched in one go, cut into jobs at line ends for the workers to share;
+// a line that continues into the next piece is searched separately, as a
+// whole. Small documents are searched on the main thread alone.
+void findScan(struct findState *f) {
+  struct findWork w = {f->query, strlen(f->query), f->re, NULL, 0, 0,
+                       PTHREAD_MUTEX_INITIALIZER, KILO_FIND_MAX};
+  int jcap = 0;
+  size_t n;
+  struct piece **v = ptPieces(&E.pt, &n);
+  size_t size = E.pt.root ? E.pt.root->sum_len : 0;
+
+  int nthreads = 1;
+  if (size >= KILO_FIND_PAR_MIN) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus < 1 ? 1 : (cpus > KILO_FIND_THREADS ? KILO_FIND_THREADS : cpus);
+  }
+  size_t chunk = size / (nthreads * 4);
+  if (chunk < KILO_FIND_CHUNK) chunk = KILO_FIND_CHUNK;
+
+  int line = 0;
+  int inside = 0; // the line at the start of this piece is already done
+  for (size_t j = 0; j < n; j++) {
+    struct ptBuffer *b = &E.pt.bufs[v[j]->buf];
+    size_t off = v[j]->off, len = v[j]->len, nls = v[j]->nl;
+    size_t first = ptBufLowerBound(b, off); // first newline in the piece
+    size_t k = 0;
+    if (inside) {
+      if (nls == 0) continue;
+      k = b->nl[first] - off + 1;
+      first++;
+      nls--;
+      line++;
+      inside = 0;
+    }
+    if (nls > 0) {
+      size_t end = b->nl[first + nls - 1] - off + 1;
+      size_t from = off + k, to = off + end;
+      while (from < to) {
+        size_t cut = to, last = first + nls - 1;
+        if (to - from > chunk) {
+          last = ptBufLowerBound(b, from + chunk);
+          cut = b->nl[last] + 1;
+        }
+        findAddJob(&w.jobs, &w.njobs, &jcap, b, from, cut - from, first, line, last - first + 1);
+        line += last - first + 1;
+        nls -= last - first + 1;
+        first = last + 1;
+        from = cut;
       }
+      k = end;
     }
-    close(fd);
+    if (k < len) {
+      findAddJob(&w.jobs, &w.njobs, &jcap, NULL, 0, 0, 0, line, 1);
+      inside = 1;
+    }
+  }
+  free(v);
+
+  findMemmem(w.query, w.qlen, w.query, w.qlen); // pick the kernel up front
+  pthread_t tid[KILO_FIND_THREADS];
+  int started = 0;
+  while (started < nthreads - 1 &&
+         pthread_create(&tid[started], NULL, findWorker, &w) == 0) started++;
+  findWorker(&w);
+  for (int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&w.lock);
+
+  // Gather in document order. A job the room ran out on while the array
+  // still wants what it left out is searched again, so that the array stays
+  // a prefix of all the matches.
+  for (int i = 0; i < w.njobs; i++) {
+    struct findJob *j = &w.jobs[i];
+    if (!j->len) {
+      findInLine(f, j->line);
+      continue;
+    }
+    if (j->count < j->total && f->count + j->count < KILO_FIND_MAX) {
+      long long total = f->total;
+      for (int l = j->line; l < j->line + j->lines && f->count < KILO_FIND_MAX; l++)
+        findInLine(f, l);
+      f->total = total + j->total;
+    } else {
+      for (int x = 0; x < j->count; x++) findAdd(f, j->m[x].line, j->m[x].col, j->m[x].len);
+      f->total += j->total - j->count;
+    }
+    free(j->m);
   }
+  free(w.jobs);
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void findFreeRegex(struct findState *f) {
+  if (f->rm) reMatcherFree(f->rm);
+  free(f->rm);
+  reFree(f->re);
+  f->rm = NULL;
+  f->re = NULL;
+  f->error = NULL;
 }
 
-/*** find ***/
+// Forget the last query, as the document may have changed since
+void findReset(struct findState *f, int regex) {
+  free(f->query);
+  f->query = NULL;
+  findFreeRegex(f);
+  f->regex = regex;
+  f->count = 0;
+  f->total = 0;
+  f->current = -1;
+}
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+// Run the query. When it only adds to the end of the previous one, its
+// matches can only be on lines the previous one matched, so only those are
+// searched again, unless there are so many that a scan is cheaper.
+void findUpdate(struct findState *f, const char *query) {
+  size_t qlen = strlen(query);
+  size_t plen = f->query ? strlen(f->query) : 0;
+  if (f->query && !strcmp(query, f->query)) return;
+  long long start = perfBegin();
+  int narrow = !f->regex && plen > 0 && qlen > plen && !strncmp(query, f->query, plen) &&
+               f->count == f->total && f->count < E.numrows / 4;
+
+  free(f->query);
+  f->query = strdup(query);
+  f->current = -1;
+  if (f->regex) {
+    findFreeRegex(f);
+    if (qlen) f->re = reCompile(query, &f->error);
+    if (f->re) {
+      f->rm = malloc(sizeof(struct reMatcher));
+      reMatcherInit(f->rm, f->re);
+    }
+  }
+  if (narrow) {
+    struct findMatch *old = f->m;
+    int oldcount = f->count;
+    f->m = NULL;
+    f->count = f->cap = 0;
+    f->total = 0;
+    for (int i = 0; i < oldcount; i++) {
+      if (i > 0 && old[i].line == old[i - 1].line) continue;
+      findInLine(f, old[i].line);
+    }
+    free(old);
+  } else {
+    f->count = 0;
+    f->total = 0;
+    if (qlen && (f->re || !f->regex)) findScan(f);
+  }
+  if (f->count) f->current = 0;
+  perfEnd(PERF_SEARCH, start, f->total < INT_MAX ? f->total : INT_MAX);
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+void editorFindCallback(char *query, int key) {
+  static int saved_hl_line = -1;
+  struct findState *f = &E.find;
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+  if (saved_hl_line >= 0) {
+    // Only a row still in the cache carries the match colours
+    editorInvalidateRow(saved_hl_line);
+    saved_hl_line = -1;
   }
 
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
     return;
   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
+    if (f->count) f->current = (f->current + 1) % f->count;
   } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+    if (f->count) f->current = (f->current + f->count - 1) % f->count;
   } else {
-    last_match = -1;
-    direction = 1;
+    findUpdate(f, query);
   }
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-
-    editor_row *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cursor_y = current;
-      E.cursor_x = editorRowRxToCx(row, match - row->render);
-      E.row_offset = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
-  }
+  if (f->current < 0) return;
+  struct findMatch *m = &f->m[f->current];
+  E.cursor_y = m->line;
+  E.cursor_x = m->col;
+  E.row_offset = E.numrows;
+  // Scroll now so that a wide row is highlighted around the match
+  editorScroll();
+
+  editor_row *row = editorRowAt(m->line);
+  editorRowHighlight(row);
+  int rx = editorRowCursorXToRenderX(row, m->col) - row->render_off;
+  int end = editorRowCursorXToRenderX(row, m->col + m->len) - row->render_off;
+  if (rx < 0) rx = 0;
+  if (end > row->rsize) end = row->rsize;
+  saved_hl_line = m->line;
+  if (end > rx) memset(&row->hl[rx], HL_MATCH, end - rx);
 }
 
-void editorFind() {
+void editorFind(int regex) {
   int saved_cx = E.cursor_x;
   int saved_cy = E.cursor_y;
   int saved_col_offset = E.col_offset;
   int saved_row_offset = E.row_offset;
 
-  char *query = editorPrompt("Search: %s (Use ESC|Arrows|Enter)",
+  // Results from before may predate edits
+  findReset(&E.find, regex);
+  E.find.active = 1;
+
+  char *query = editorPrompt(regex ? "Regex: %s (Use ESC|Arrows|Enter)"
+                                   : "Search: %s (Use ESC|Arrows|Enter)",
                              editorFindCallback);
+  E.find.active = 0;
 
   if (query) {
     free(query);
@@ -729,24 +4728,29 @@ void editorFind() {
 struct abuf {
   char *b; // pointer point to buffer
   int len;
+  int cap; // bytes allocated at b
 };
 
-#define ABUF_INIT {NULL, 0} // Empty buffer act as a constructor for abuf type
+#define ABUF_INIT {NULL, 0, 0} // Empty buffer act as a constructor for abuf type
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-  // ab->b == (*ab).b access b from ab pointer and the same with (*ab).len
-  // realloc() accept two args pointer and new size
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL) return;
+  // Grow by doubling, so appending byte by byte still costs only a few
+  // reallocs per frame
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
 
   // memcpy() copy block of memory to another location
   // accept 3 args 
-  // 1. where to copy to - &new[ab->len]
+  // 1. where to copy to - &ab->b[ab->len]
   // 2. source pointer - s
   // 3. number of bytes to copy - len
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
@@ -759,7 +4763,7 @@ void abFree(struct abuf *ab) {
 void editorScroll() {
   E.render_x = 0;
   if (E.cursor_y < E.numrows) {
-    E.render_x = editorRowCursorXToRenderX(&E.row[E.cursor_y], E.cursor_x);
+    E.render_x = editorRowCursorXToRenderX(editorRowAt(E.cursor_y), E.cursor_x);
   }
 
   // Check if cursor move above the visible area
@@ -779,7 +4783,126 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
+// Size g for the screen plus the two bars, blank
+void gridResize(struct screenGrid *g, int rows, int cols) {
+  g->rows = rows;
+  g->cols = cols;
+  g->chars = realloc(g->chars, rows * cols);
+  g->attrs = realloc(g->attrs, rows * cols);
+  g->glyphs = realloc(g->glyphs, rows * cols * sizeof(struct gridGlyph));
+  g->glyph_rows = realloc(g->glyph_rows, rows);
+  memset(g->glyph_rows, 0, rows);
+  memset(g->chars, ' ', rows * cols);
+  memset(g->attrs, 0, rows * cols);
+}
+
+// Put the character s[0..len) of `width` columns at (y, x). One that
+// doesn't fit before the edge leaves blanks.
+void gridPutGlyph(struct screenGrid *g, int y, int x, const char *s, int len,
+                  int width, int attr) {
+  int i = y * g->cols + x;
+  if (x + width > g->cols || len > (int)sizeof(g->glyphs[i].b)) {
+    for (; x < g->cols && width-- > 0; x++, i++) {
+      g->chars[i] = ' ';
+      g->attrs[i] = attr;
+    }
+    return;
+  }
+  // Zero-filled, so that cells compare as a whole
+  struct gridGlyph gg = { len, { 0 } };
+  memcpy(gg.b, s, len);
+  g->glyph_rows[y] = 1;
+  g->chars[i] = GRID_GLYPH;
+  g->attrs[i] = attr;
+  g->glyphs[i] = gg;
+  if (width == 2) {
+    g->chars[i + 1] = GRID_WIDE;
+    g->attrs[i + 1] = attr;
+  }
+}
+
+// Write len bytes of ASCII at (y, x) with one attribute, clipped to the row
+void gridPutAscii(struct screenGrid *g, int y, int x, const char *s, int len, int attr) {
+  if (x + len > g->cols) len = g->cols - x;
+  if (len <= 0) return;
+  memcpy(&g->chars[y * g->cols + x], s, len);
+  memset(&g->attrs[y * g->cols + x], attr, len);
+}
+
+// The same for UTF-8 text
+void gridPut(struct screenGrid *g, int y, int x, const char *s, int len, int attr) {
+  if (utf8SkipAscii(s, 0, len, '\0') < len) {
+    int i = 0;
+    while (i < len && x < g->cols) {
+      int cp, n = utf8Decode(&s[i], len - i, &cp);
+      if (cp < 0x80) {
+        gridPutAscii(g, y, x++, cp < 0 ? "?" : &s[i], 1, attr);
+      } else if (utf8Width(cp)) {
+        gridPutGlyph(g, y, x, &s[i], n, utf8Width(cp), attr);
+        x += utf8Width(cp);
+      }
+      i += n;
+    }
+    return;
+  }
+  gridPutAscii(g, y, x, s, len, attr);
+}
+
+// Draw the glyph of row that render column rx falls in at (y, x), with the
+// combining marks that follow it. Returns the cells used. *k is a glyph
+// at or before it, the walk along the row goes on from there.
+int editorDrawGlyph(struct screenGrid *g, int y, int x, editor_row *row, int rx,
+                    int *k, int attr) {
+  while (row->glyphs[*k].rx <= rx) (*k)++;
+  struct rowGlyph *gl = &row->glyphs[*k];
+  int start = gl->rx - gl->width;
+  if (start < rx) {
+    // The right half of a double-width character at the left edge
+    gridPutAscii(g, y, x, " ", 1, attr);
+    return gl->rx - rx;
+  }
+  int cp;
+  utf8Decode(&row->chars[gl->cx], gl->len, &cp);
+  if (cp < 0xA0) {
+    // Not valid UTF-8, or a C1 control character
+    gridPutAscii(g, y, x, "?", 1, ATTR_REVERSE);
+    return 1;
+  }
+  int len = gl->len;
+  for (int m = *k + 1; m < row->nglyphs && row->glyphs[m].width == 0 &&
+       row->glyphs[m].cx == gl->cx + len &&
+       len + row->glyphs[m].len <= (int)sizeof(g->glyphs[0].b); m++) {
+    len += row->glyphs[m].len;
+  }
+  gridPutGlyph(g, y, x, &row->chars[gl->cx], len, gl->width, attr);
+  return gl->width;
+}
+
+// Combining marks have no cell of their own. editorDrawGlyph() puts those
+// after a non-ASCII character in its cell, this the ones after ASCII.
+void editorDrawMarks(struct screenGrid *g, int y, editor_row *row, int len) {
+  for (int k = editorRowGlyphAt(row, E.col_offset); k < row->nglyphs; k++) {
+    struct rowGlyph *gl = &row->glyphs[k];
+    int x = gl->rx - 1 - E.col_offset;
+    if (x >= len) break;
+    if (gl->width != 0 || gl->cx == 0) continue;
+    unsigned char base = row->chars[gl->cx - 1];
+    if (base < ' ' || base >= 0x7f) continue;
+
+    char b[sizeof(g->glyphs[0].b)];
+    int n = 1;
+    b[0] = base;
+    while (k < row->nglyphs && row->glyphs[k].width == 0 &&
+           row->glyphs[k].cx == gl->cx + n - 1 && n + row->glyphs[k].len <= (int)sizeof(b)) {
+      memcpy(&b[n], &row->chars[row->glyphs[k].cx], row->glyphs[k].len);
+      n += row->glyphs[k++].len;
+    }
+    k--;
+    gridPutGlyph(g, y, x, b, n, 1, g->attrs[y * g->cols + x]);
+  }
+}
+
+void editorDrawRows(struct screenGrid *g) {
   int y;
   for (y = 0; y < E.screen_rows; y++) {
     int file_row = y + E.row_offset;
@@ -791,129 +4914,275 @@ void editorDrawRows(struct abuf *ab) {
         "What is this sorcery -- version %s", KILO_VERSION);
 
         if (welcome_len > E.screen_cols) welcome_len = E.screen_cols;
-          
+
         // padding value for one side
-        int padding = (E.screen_cols - welcome_len) / 2; 
-
-        // if append any char or whitespace padding--
-        // loop till there no padding left
-        // then append welcome message to buffer
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
+        int padding = (E.screen_cols - welcome_len) / 2;
 
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcome_len);
+        if (padding) gridPut(g, y, 0, "~", 1, 0);
+        gridPut(g, y, padding, welcome, welcome_len, 0);
       } else {
-        abAppend(ab, "~", 1);   
+        gridPut(g, y, 0, "~", 1, 0);
       }
     } else {
-      int len = E.row[file_row].rsize - E.col_offset;
+      editor_row *row = editorRowAt(file_row);
+      editorRowHighlight(row);
+      // Wide rows hold render columns from render_off on
+      int off = E.col_offset - row->render_off;
+      int len = row->rsize - off;
       if (len < 0) len = 0;
       if (len > E.screen_cols) len = E.screen_cols;
-      char *c = &E.row[file_row].render[E.col_offset];
-      unsigned char *hl = &E.row[file_row].hl[E.col_offset];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
+      char *c = &row->render[off];
+      unsigned char *hl = &row->hl[off];
+      int j = 0, k = -1;
+      while (j < len) {
+        if (c[j] == RENDER_GLYPH) {
+          if (k < 0) k = editorRowGlyphAt(row, E.col_offset);
+          j += editorDrawGlyph(g, y, j, row, E.col_offset + j, &k,
+                               hl[j] == HL_NORMAL ? 0 : editorSyntaxToColor(hl[j]));
+          continue;
+        }
         if (iscntrl(c[j])) {
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          gridPutAscii(g, y, j, &sym, 1, ATTR_REVERSE);
+          j++;
+          continue;
         }
+        // A run of one highlight goes in as one span
+        int e = j + 1;
+        while (e < len && hl[e] == hl[j] && !iscntrl(c[e]) && c[e] != RENDER_GLYPH) e++;
+        gridPutAscii(g, y, j, &c[j], e - j, hl[j] == HL_NORMAL ? 0 : editorSyntaxToColor(hl[j]));
+        j = e;
       }
-      abAppend(ab, "\x1b[39m", 5);      
+      if (row->nglyphs) editorDrawMarks(g, y, row, len);
     }
-
-    // K is delete in line and 0 args is erase right of cursor
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  // m command is Select Graphic Rendition
-  // 1 bold, 4 underscore, 5 blink, 7 inverted colors
-  abAppend(ab, "\x1b[7m", 4);
-
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+void editorDrawStatusBar(struct screenGrid *g) {
+  int y = E.screen_rows;
+  char status[80], rstatus[80], saving[32] = "", which[32] = "";
+  if (E.save.active) {
+    size_t written = __sync_fetch_and_add(&E.save.written, 0);
+    snprintf(saving, sizeof(saving), " (saving %d%%)",
+             E.save.total ? (int)(written * 100 / E.save.total) : 100);
+  }
+  if (E.nbuffers > 1) snprintf(which, sizeof(which), "[%d/%d] ", E.buffer + 1, E.nbuffers);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s", which,
                      E.filename ? E.filename : "[No name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                      E.syntax ? E.syntax->filetype : "no ft", 
-                      E.cursor_y + 1, E.numrows);
+                     E.dirty ? "(modified)" : "", saving);
+  int rlen;
+  if (E.find.active && E.find.error)
+    rlen = snprintf(rstatus, sizeof(rstatus), "bad regex: %s", E.find.error);
+  else if (E.find.active)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%d/%lld matches",
+                    E.find.current + 1, E.find.total);
+  else
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+                    E.syntax ? E.syntax->filetype : "no ft",
+                    E.cursor_y + 1, E.numrows);
   if (len > E.screen_cols) len = E.screen_cols;
-  abAppend(ab, status, len);
-  while (len < E.screen_cols) {
-    if (E.screen_cols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  // Inverted colours across the whole bar
+  memset(&g->attrs[y * g->cols], ATTR_REVERSE, g->cols);
+  gridPut(g, y, 0, status, len, ATTR_REVERSE);
+  if (E.screen_cols - len >= rlen)
+    gridPut(g, y, E.screen_cols - rlen, rstatus, rlen, ATTR_REVERSE);
+}
+
+// Ctrl-P overlay at the right of the message bar: how the last frame went.
+// Returns the columns it takes.
+int editorDrawPerf(struct screenGrid *g) {
+  struct perfCounters *f = &E.perf.frame;
+  char hud[128];
+  int len = snprintf(hud, sizeof(hud),
+                     " frame %.2fms hl %lld rows %.2fms render %.2fms out %lldB write %.2fms key %.2fms ",
+                     f->ns[PERF_FRAME] / 1e6, f->count[PERF_HIGHLIGHT], f->ns[PERF_HIGHLIGHT] / 1e6,
+                     f->ns[PERF_RENDER] / 1e6, f->out_bytes, f->ns[PERF_WRITE] / 1e6,
+                     E.perf.latency_ns / 1e6);
+  if (len > E.screen_cols) len = E.screen_cols;
+  gridPut(g, E.screen_rows + 1, E.screen_cols - len, hud, len, ATTR_REVERSE);
+  return len;
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct screenGrid *g) {
+  int cols = E.screen_cols;
+  if (E.perf.hud) cols -= editorDrawPerf(g);
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screen_cols) msglen = E.screen_cols;
+  if (msglen > cols) msglen = cols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    gridPut(g, E.screen_rows + 1, 0, E.statusmsg, msglen, 0);
+}
+
+// SGR sequence switching to attribute attr, each one formatted once
+void editorEmitAttr(struct abuf *ab, int attr) {
+  static char sgr[256][16];
+  static int sgr_len[256];
+  if (sgr_len[attr] == 0) {
+    if (attr == 0)
+      sgr_len[attr] = snprintf(sgr[attr], sizeof(sgr[attr]), "\x1b[m");
+    else
+      sgr_len[attr] = snprintf(sgr[attr], sizeof(sgr[attr]), "\x1b[0%s;%dm",
+                               (attr & ATTR_REVERSE) ? ";7" : "",
+                               (attr & ATTR_COLOR) ? attr & ATTR_COLOR : 39);
+  }
+  abAppend(ab, sgr[attr], sgr_len[attr]);
+}
+
+// Whether cell i shows the same in both grids, for rows with glyphs
+int gridSame(struct screenGrid *g, struct screenGrid *old, int i) {
+  if (g->chars[i] != old->chars[i] || g->attrs[i] != old->attrs[i]) return 0;
+  if (g->chars[i] != GRID_GLYPH) return 1;
+  return !memcmp(&g->glyphs[i], &old->glyphs[i], sizeof(struct gridGlyph));
+}
+
+// Append the cells from..to-1 of g. Glyph cells give their character, the
+// cells they cover nothing.
+void gridEmitCells(struct abuf *ab, struct screenGrid *g, int from, int to) {
+  while (from < to) {
+    int i = utf8SkipAscii(g->chars, from, to, '\0');
+    abAppend(ab, &g->chars[from], i - from);
+    if (i == to) break;
+    if (g->chars[i] == GRID_GLYPH) abAppend(ab, g->glyphs[i].b, g->glyphs[i].len);
+    else if (g->chars[i] != GRID_WIDE) abAppend(ab, &g->chars[i], 1);
+    from = i + 1;
+  }
+}
+
+// Append what turns the terminal from showing E.shadow into showing
+// E.frame: a cursor move and the cells of each changed span. Spans a few
+// cells apart are merged, as rewriting a short gap is cheaper than another
+// cursor move, and a changed row that ends in blanks is cut short with K.
+void editorEmitChanges(struct abuf *ab) {
+  struct screenGrid *g = &E.frame, *old = &E.shadow;
+  int attr = 0;
+  for (int y = 0; y < g->rows; y++) {
+    char *c = &g->chars[y * g->cols], *oc = &old->chars[y * g->cols];
+    unsigned char *a = &g->attrs[y * g->cols], *oa = &old->attrs[y * g->cols];
+    // Rows of ASCII compare and go out byte by byte. Two cells can differ
+    // in their glyph only if the new one has one.
+    int glyphs = g->glyph_rows[y];
+
+    int blank = g->cols; // the row is blank from here on
+    while (blank > 0 && c[blank - 1] == ' ' && a[blank - 1] == 0) blank--;
+
+    int x = 0;
+    while (x < g->cols) {
+      if (c[x] == oc[x] && a[x] == oa[x] &&
+          (!glyphs || gridSame(g, old, y * g->cols + x))) {
+        x++;
+        continue;
+      }
+      int end = x + 1, same = 0;
+      for (int k = x + 1; k < g->cols && same < 8; k++) {
+        if (c[k] == oc[k] && a[k] == oa[k] &&
+            (!glyphs || gridSame(g, old, y * g->cols + k))) {
+          same++;
+        } else {
+          same = 0;
+          end = k + 1;
+        }
+      }
+
+      char buf[32];
+      int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+      abAppend(ab, buf, len);
+      int stop = (end > blank) ? (x > blank ? x : blank) : end;
+      while (x < stop) {
+        // Cells of one attribute go out as one span
+        int k = x + 1;
+        while (k < stop && a[k] == a[x]) k++;
+        if (a[x] != attr) {
+          attr = a[x];
+          editorEmitAttr(ab, attr);
+        }
+        if (glyphs) gridEmitCells(ab, g, y * g->cols + x, y * g->cols + k);
+        else abAppend(ab, &c[x], k - x);
+        x = k;
+      }
+      if (end > blank) {
+        // K erases with the current background
+        if (attr != 0) {
+          attr = 0;
+          editorEmitAttr(ab, attr);
+        }
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+    }
+  }
+  if (attr != 0) editorEmitAttr(ab, 0);
 }
 
-// Append to buffer before write it to terminal
+// Draw the next frame into E.frame, then send the terminal only what
+// differs from the last one
 void editorRefreshScreen() {
+  long long start = perfBegin();
+  E.perf.frame_start = E.perf.total;
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
+  if (E.frame.rows != E.screen_rows + 2 || E.frame.cols != E.screen_cols) {
+    gridResize(&E.frame, E.screen_rows + 2, E.screen_cols);
+    E.shadow_valid = 0;
+  }
+
+  // Kept between frames, so its memory is reused
+  static struct abuf ab = ABUF_INIT;
+  ab.len = 0;
 
   // l command => Reset mode
   // h command => Set mode
   // ?25 arguments hide/showing cursor
   abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-  abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  if (!E.shadow_valid) {
+    // Start over from a cleared screen
+    abAppend(&ab, "\x1b[m\x1b[2J", 7);
+    gridResize(&E.shadow, E.frame.rows, E.frame.cols);
+    E.shadow_valid = 1;
+  }
+
+  memset(E.frame.chars, ' ', E.frame.rows * E.frame.cols);
+  memset(E.frame.glyph_rows, 0, E.frame.rows);
+  memset(E.frame.attrs, 0, E.frame.rows * E.frame.cols);
+  long long t = perfBegin();
+  editorDrawRows(&E.frame);
+  editorDrawStatusBar(&E.frame);
+  editorDrawMessageBar(&E.frame);
+  perfEnd(PERF_RENDER, t, 0);
+  E.hl_stale = 0;
+  t = perfBegin();
+  editorEmitChanges(&ab);
+  perfEnd(PERF_DIFF, t, 0);
+
+  struct screenGrid tmp = E.shadow;
+  E.shadow = E.frame;
+  E.frame = tmp;
 
   // This buffer instruct terminal to move cursor supplied coordinated
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.row_offset) + 1, 
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.row_offset) + 1,
                                             (E.render_x - E.col_offset) + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6); // show cursor
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  t = perfBegin();
+  // What the terminal didn't get can't be diffed against, start over
+  struct iovec iov = { ab.b, ab.len };
+  if (editorWritev(STDOUT_FILENO, &iov, 1) == -1) E.shadow_valid = 0;
+  perfEnd(PERF_WRITE, t, 0);
+  E.perf.total.out_bytes += ab.len;
+  perfEnd(PERF_FRAME, start, ab.len);
+  perfDiff(&E.perf.frame, &E.perf.total, &E.perf.frame_start);
+
+  E.frame_ns = editorClock();
+  if (E.input_ns) {
+    long long lat = E.frame_ns - E.input_ns;
+    E.lat_sum_ns += lat;
+    if (lat > E.lat_max_ns) E.lat_max_ns = lat;
+    E.lat_frames++;
+    E.input_ns = 0;
+    E.perf.latency_ns = lat;
+  }
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -939,7 +5208,8 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CRTL_KEY('h') || c == BACKSPACE) {
-      if (buflen != 0) buf[--buflen] = '\0';
+      if (buflen != 0) buflen = utf8Prev(buf, buflen);
+      buf[buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback) callback(buf, c);
@@ -951,7 +5221,19 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c == PASTE_START) {
+      size_t len;
+      char *text = editorReadPaste(&len);
+      for (size_t i = 0; i < len; i++) {
+        if (iscntrl((unsigned char)text[i])) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = text[i];
+      }
+      buf[buflen] = '\0';
+    } else if (c < 256 && !iscntrl(c)) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -966,7 +5248,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
   // check the cursor if it on the actual line if it is row will point to editor_row[E.cursor_y]
-  editor_row *row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+  editor_row *row = (E.cursor_y >= E.numrows) ? NULL : editorRowAt(E.cursor_y);
 
   switch (key) {
     case ARROW_UP:
@@ -981,15 +5263,15 @@ void editorMoveCursor(int key) {
       break;
     case ARROW_LEFT:
       if (E.cursor_x != 0) {
-        E.cursor_x--;
+        E.cursor_x = editorRowPrevChar(row, E.cursor_x);
       } else if (E.cursor_y > 0) {
         E.cursor_y--;
-        E.cursor_x = E.row[E.cursor_y].size;
+        E.cursor_x = editorRowAt(E.cursor_y)->size;
       }
       break;
     case ARROW_RIGHT:
       if (row && E.cursor_x < row->size) {
-        E.cursor_x++;
+        E.cursor_x = editorRowNextChar(row, E.cursor_x);
       } else if (row && E.cursor_x == row->size) {
         E.cursor_y++;
         E.cursor_x = 0;
@@ -997,17 +5279,29 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+  row = (E.cursor_y >= E.numrows) ? NULL : editorRowAt(E.cursor_y);
   int rowlen = row ? row->size : 0;
   if (E.cursor_x > rowlen) {
     E.cursor_x = rowlen;
   }
+  // Not in the middle of a character
+  while (E.cursor_x > 0 && E.cursor_x < rowlen &&
+         ((unsigned char)row->chars[E.cursor_x] & 0xC0) == 0x80) E.cursor_x--;
+}
+
+// Bracketed paste: inserted in one go rather than typed key by key
+void editorPaste() {
+  size_t len;
+  char *text = editorReadPaste(&len);
+  editorInsertText(text, len);
 }
 
 void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  long long start = perfBegin();
+  editorUndoKey(c);
 
   switch (c) {
     case '\r':
@@ -1015,15 +5309,21 @@ void editorProcessKeypress() {
       break;
 
     case CRTL_KEY('q'): // ASCII 17 | 0x11
-      if (E.dirty && quit_times > 0) {
+      if (editorAnyDirty() && quit_times > 0) {
         editorSetStatusMessage("Warning!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
-      
+      editorSaveWait(); // a save under way still gets to finish
+
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
+      if (getenv("KILO_LATENCY") && E.lat_frames)
+        fprintf(stderr, "keystroke to paint: %d frames, mean %lld us, max %lld us\r\n",
+                E.lat_frames, E.lat_sum_ns / E.lat_frames / 1000, E.lat_max_ns / 1000);
+      if (getenv("KILO_MEMSTATS")) editorMemStats();
+      perfTraceWrite();
       exit(0);
       break;
 
@@ -1031,17 +5331,33 @@ void editorProcessKeypress() {
       editorSave();
       break;
 
+    case PASTE_START:
+      editorPaste();
+      break;
+
     case HOME_KEY:
       E.cursor_x = 0;
       break;
 
     case END_KEY:
       if (E.cursor_y < E.numrows)
-        E.cursor_x = E.row[E.cursor_y].size;
+        E.cursor_x = editorRowAt(E.cursor_y)->size;
+      break;
+
+    case CRTL_KEY('z'):
+      editorUndo(0);
+      break;
+
+    case CRTL_KEY('y'):
+      editorUndo(1);
       break;
 
     case CRTL_KEY('f'):
-      editorFind();
+      editorFind(0);
+      break;
+
+    case CRTL_KEY('r'):
+      editorFind(1);
       break;
 
     case BACKSPACE:
@@ -1075,6 +5391,25 @@ void editorProcessKeypress() {
       break;
 
     case CRTL_KEY('l'):
+      E.shadow_valid = 0;
+      break;
+
+    case CRTL_KEY('p'):
+      E.perf.hud = !E.perf.hud;
+      break;
+
+    case CRTL_KEY('o'):
+      editorOpenPrompt();
+      break;
+
+    case CRTL_KEY('n'):
+      editorSwitchBuffer((E.buffer + 1) % E.nbuffers);
+      break;
+
+    case CRTL_KEY('b'):
+      editorBufferList();
+      break;
+
     case '\x1b':
       break;
 
@@ -1084,40 +5419,393 @@ void editorProcessKeypress() {
   }
 
   quit_times = KILO_QUIT_TIMES;
+  perfEnd(PERF_KEY, start, c);
+}
+
+// Handle the keys that are already waiting, and those that arrive before
+// the next frame is due, so a burst of input costs one redraw
+void editorProcessPending() {
+  for (;;) {
+    if (E.input.pos < E.input.len) {
+      editorProcessKeypress();
+      continue;
+    }
+    long long wait = E.frame_ns + KILO_FRAME_NS - editorClock();
+    if (!editorPollInput(wait > 0 ? (wait + 999999) / 1000000 : 0)) return;
+  }
+}
+
+/*** bench ***/
+
+// kilo --bench SCRIPT [FILE] runs the editor without a terminal: keys come
+// from SCRIPT, frames go to /dev/null, and what each line of the script
+// cost is printed as it finishes. One command per line, # starts a comment:
+//
+//   open [PATH]        load PATH, or else FILE
+//   buffer PATH        show PATH in a buffer of its own, see editorOpenBuffer()
+//   type "TEXT"        type TEXT, a key at a time
+//   paste "TEXT" [N]   paste TEXT repeated N times, in one go
+//   key NAME           up down left right pgup pgdn home end del bs enter
+//                      esc undo redo next (buffer)
+//   find "TEXT"        search, and Enter on what is found; regex likewise
+//   goto LINE          jump to a line
+//   save [inplace]     save, and wait for the write to finish; inplace acts
+//                      as if the directory took no temp file
+//   verify             check the file holds what the document does
+//   idle               highlight the rest of the file, as while waiting
+//   replay PATH        the keys of a session run with KILO_RECORD=PATH
+//   size ROWS COLS     resize the terminal
+//
+// Any command can end in *N to run it N times. Each key, and each other
+// command, is one sample: from handling it to the frame after it written.
+
+struct benchSamples {
+  long long *ns;
+  int n, cap;
+};
+
+struct benchKey {
+  const char *name;
+  const char *seq;
+};
+
+const struct benchKey bench_keys[] = {
+  {"up", "\x1b[A"}, {"down", "\x1b[B"}, {"right", "\x1b[C"}, {"left", "\x1b[D"},
+  {"pgup", "\x1b[5~"}, {"pgdn", "\x1b[6~"}, {"home", "\x1b[H"}, {"end", "\x1b[F"},
+  {"del", "\x1b[3~"}, {"bs", "\x7f"}, {"enter", "\r"}, {"esc", "\x1b"},
+  {"undo", "\x1a"}, {"redo", "\x19"}, {"next", "\x0e"}
+};
+
+void benchAdd(struct benchSamples *s, long long ns) {
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->ns = realloc(s->ns, sizeof(long long) * s->cap);
+  }
+  s->ns[s->n++] = ns;
+}
+
+int benchCompare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Queue input as if the terminal had sent it
+void benchFeed(const char *s, size_t len) {
+  struct inputBuffer *in = &E.input;
+  if (in->pos == in->len) in->pos = in->len = 0;
+  if (in->cap - in->len < len) {
+    while (in->cap - in->len < len) in->cap = in->cap ? in->cap * 2 : 4096;
+    in->b = realloc(in->b, in->cap);
+  }
+  memcpy(&in->b[in->len], s, len);
+  in->len += len;
+}
+
+// Handle all the queued keys, a frame after each
+void benchKeys(struct benchSamples *s) {
+  while (E.input.pos < E.input.len) {
+    long long start = editorClock();
+    editorProcessKeypress();
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  }
+  E.input.pos = E.input.len = 0;
+}
+
+// Next word of the line at *p, or "quoted text" with C escapes, decoded in
+// place. NULL at the end of the line.
+char *benchArg(char **p, size_t *lenp, int *quoted) {
+  char *s = *p;
+  while (*s == ' ' || *s == '\t') s++;
+  if (*s == '\0' || *s == '#') return NULL;
+
+  char *arg = s, *d = s;
+  *quoted = (*s == '"');
+  if (!*quoted) {
+    while (*s && *s != ' ' && *s != '\t') s++;
+    d = s;
+  } else {
+    arg = d = ++s;
+    while (*s && *s != '"') {
+      if (*s != '\\' || s[1] == '\0') {
+        *d++ = *s++;
+        continue;
+      }
+      s++;
+      switch (*s) {
+        case 'n': *d++ = '\n'; s++; break;
+        case 'r': *d++ = '\r'; s++; break;
+        case 't': *d++ = '\t'; s++; break;
+        case 'e': *d++ = '\x1b'; s++; break;
+        case 'x': *d++ = strtol(s + 1, &s, 16); break;
+        default: *d++ = *s++; break;
+      }
+    }
+  }
+  *lenp = d - arg;
+  if (*s) s++;
+  *d = '\0';
+  *p = s;
+  return arg;
+}
+
+// Run one script command. Returns -1 if it doesn't make sense.
+int benchCommand(int argc, char **argv, size_t *argl, char *file, struct benchSamples *s) {
+  char *cmd = argv[0];
+  if (!strcmp(cmd, "open")) {
+    char *path = argc > 1 ? argv[1] : file;
+    if (path == NULL) return -1;
+    long long start = editorClock();
+    if (editorOpen(path) == -1) die("open");
+    E.cursor_x = E.cursor_y = 0;
+    E.row_offset = E.col_offset = 0;
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else if (!strcmp(cmd, "buffer") && argc == 2) {
+    long long start = editorClock();
+    editorOpenBuffer(argv[1]);
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else if (!strcmp(cmd, "type") && argc == 2) {
+    // Enter is \r from a terminal
+    for (size_t i = 0; i < argl[1]; i++)
+      benchFeed(argv[1][i] == '\n' ? "\r" : &argv[1][i], 1);
+    benchKeys(s);
+  } else if (!strcmp(cmd, "paste") && argc >= 2) {
+    int times = argc > 2 ? atoi(argv[2]) : 1;
+    benchFeed("\x1b[200~", 6);
+    for (int i = 0; i < times; i++) benchFeed(argv[1], argl[1]);
+    benchFeed("\x1b[201~", 6);
+    benchKeys(s);
+  } else if (!strcmp(cmd, "key") && argc == 2) {
+    unsigned int j = 0;
+    while (j < sizeof(bench_keys) / sizeof(bench_keys[0]) && strcmp(argv[1], bench_keys[j].name)) j++;
+    if (j == sizeof(bench_keys) / sizeof(bench_keys[0])) return -1;
+    benchFeed(bench_keys[j].seq, strlen(bench_keys[j].seq));
+    benchKeys(s);
+  } else if ((!strcmp(cmd, "find") || !strcmp(cmd, "regex")) && argc == 2) {
+    benchFeed(cmd[0] == 'f' ? "\x06" : "\x12", 1);
+    benchFeed(argv[1], argl[1]);
+    benchFeed("\r", 1);
+    benchKeys(s);
+  } else if (!strcmp(cmd, "goto") && argc == 2) {
+    long long start = editorClock();
+    E.cursor_y = atoi(argv[1]) - 1;
+    if (E.cursor_y > E.numrows) E.cursor_y = E.numrows;
+    if (E.cursor_y < 0) E.cursor_y = 0;
+    E.cursor_x = 0;
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else if (!strcmp(cmd, "save") && (argc == 1 || !strcmp(argv[1], "inplace"))) {
+    // With no file to save to, the prompt would wait for a name
+    if (E.filename == NULL) return -1;
+    long long start = editorClock();
+    E.bench.no_temp = argc > 1;
+    benchFeed("\x13", 1);
+    editorProcessKeypress();
+    editorSaveWait();
+    E.bench.no_temp = 0;
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else if (!strcmp(cmd, "verify")) {
+    if (E.filename == NULL) return -1;
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) return -1;
+    size_t len = ptLength(&E.pt), got = 0;
+    char *disk = malloc(len + 1), *doc = malloc(len + 1);
+    ssize_t n;
+    while (got <= len && (n = read(fd, &disk[got], len + 1 - got)) > 0) got += n;
+    close(fd);
+    ptCopy(&E.pt, 0, len, doc);
+    int same = got == len && !memcmp(disk, doc, len);
+    free(disk);
+    free(doc);
+    if (!same) {
+      fprintf(stderr, "%s isn't what was saved\n", E.filename);
+      return -1;
+    }
+  } else if (!strcmp(cmd, "idle")) {
+    long long start = editorClock();
+    while (E.syntax && E.hl_frontier < E.numrows) editorSyntaxIdle();
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else if (!strcmp(cmd, "replay") && argc == 2) {
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) return -1;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) benchFeed(buf, n);
+    close(fd);
+    // The session ended with Ctrl-Q, which would end this run too
+    char *quit = memchr(E.input.b, CRTL_KEY('q'), E.input.len);
+    if (quit) E.input.len = quit - E.input.b;
+    benchKeys(s);
+  } else if (!strcmp(cmd, "size") && argc == 3) {
+    if (atoi(argv[1]) < 3 || atoi(argv[2]) < 1) return -1;
+    long long start = editorClock();
+    E.screen_rows = atoi(argv[1]) - 2;
+    E.screen_cols = atoi(argv[2]);
+    editorRefreshScreen();
+    benchAdd(s, editorClock() - start);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// What a command cost: its samples, and the counters since before it ran
+void benchReport(FILE *out, const char *label, struct benchSamples *s, struct perfCounters *before) {
+  struct perfCounters d;
+  if (s->n == 0) return;
+  perfDiff(&d, &E.perf.total, before);
+  long long frames = d.count[PERF_FRAME];
+  qsort(s->ns, s->n, sizeof(long long), benchCompare);
+  double us[4] = { s->ns[(s->n - 1) * 50LL / 100], s->ns[(s->n - 1) * 90LL / 100],
+                   s->ns[(s->n - 1) * 99LL / 100], s->ns[s->n - 1] };
+  fprintf(out, "%-24.24s %6d %9.1f %9.1f %9.1f %9.1f %7lld %9.0f %8.1f %8.1f %8lld\n",
+          label, s->n, us[0] / 1000, us[1] / 1000, us[2] / 1000, us[3] / 1000,
+          frames, frames ? (double)d.out_bytes / frames : 0.0,
+          frames ? d.ns[PERF_FRAME] / 1000.0 / frames : 0.0,
+          d.ns[PERF_HIGHLIGHT] / 1000.0 / s->n, d.count[PERF_HIGHLIGHT]);
+  fflush(out);
+}
+
+int benchMain(char *script, char *file) {
+  FILE *fp = fopen(script, "r");
+  if (!fp) die(script);
+
+  // The report goes where the frames would have, and they go nowhere. Input
+  // is a pipe that never has anything to read: keys are queued directly.
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  int null = open("/dev/null", O_WRONLY);
+  int in[2];
+  if (out == NULL || null == -1 || pipe(in) == -1) die("bench");
+  fcntl(in[0], F_SETFL, O_NONBLOCK);
+  dup2(null, STDOUT_FILENO);
+  dup2(in[0], STDIN_FILENO);
+
+  E.bench.active = 1;
+  E.bench.record = -1;
+  initEditor();
+
+  fprintf(out, "%-24s %6s %9s %9s %9s %9s %7s %9s %8s %8s %8s\n", "op", "n",
+          "p50 us", "p90 us", "p99 us", "max us", "frames", "B/frame",
+          "draw us", "hl us", "hl rows");
+
+  struct benchSamples s = {NULL, 0, 0};
+  char line[KILO_BENCH_LINE], label[KILO_BENCH_LINE];
+  int lineno = 0;
+  long long start = editorClock();
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    char *p = line + strspn(line, " \t");
+    snprintf(label, sizeof(label), "%s", p);
+
+    char *argv[8];
+    size_t argl[8];
+    int quoted = 0, argc = 0;
+    while (argc < 8 && (argv[argc] = benchArg(&p, &argl[argc], &quoted)) != NULL) argc++;
+    if (argc == 0) continue;
+    int times = 1;
+    if (argc > 1 && !quoted && argv[argc - 1][0] == '*') times = atoi(&argv[--argc][1]);
+
+    s.n = 0;
+    struct perfCounters before = E.perf.total;
+    for (int i = 0; i < times; i++) {
+      if (benchCommand(argc, argv, argl, file, &s) == -1) {
+        fprintf(stderr, "%s:%d: can't run \"%s\"\n", script, lineno, label);
+        exit(1);
+      }
+    }
+    benchReport(out, label, &s, &before);
+  }
+  fprintf(out, "total %.1f ms\n", (editorClock() - start) / 1e6);
+  fclose(fp);
+  editorSaveWait();
+  perfTraceWrite();
+  return 0;
 }
 
 /*** init ***/
 
 void initEditor() {
-  E.cursor_x = 0;
-  E.cursor_y = 0;
-  E.render_x = 0;
-  E.numrows = 0;
-  E.row_offset = 0;
-  E.row = NULL;
-  E.dirty = 0;
-  E.filename = NULL;
+  editorBufferInit();
+  E.buffers = malloc(sizeof(struct editorBuffer));
+  E.nbuffers = 1;
+  E.buffer = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  E.syntax = NULL;
+  memset(&E.frame, 0, sizeof(E.frame));
+  memset(&E.shadow, 0, sizeof(E.shadow));
+  E.shadow_valid = 0;
+  E.hl_stale = 0;
+  memset(&E.input, 0, sizeof(E.input));
+  memset(&E.find, 0, sizeof(E.find));
+  memset(&E.arena, 0, sizeof(E.arena));
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) editorCompileSyntax(&HLDB[j]);
+
+  E.sigfd = -1;
+  E.frame_ns = 0;
+  E.input_ns = 0;
+  E.lat_sum_ns = E.lat_max_ns = 0;
+  E.lat_frames = 0;
+  memset(&E.perf, 0, sizeof(E.perf));
+  E.perf.trace_path = getenv("KILO_TRACE");
+  E.perf.t0 = editorClock();
+
+  E.undo_max = KILO_UNDO_MAX;
+  char *undo_max = getenv("KILO_UNDO_MAX");
+  if (undo_max) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(undo_max, &end, 10);
+    if (errno || end == undo_max || *end || n <= 0) {
+      errno = EINVAL;
+      die("KILO_UNDO_MAX");
+    }
+    E.undo_max = n;
+  }
 
-  if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) die("getWindowSize");
+  if (E.bench.active) {
+    E.screen_rows = KILO_BENCH_ROWS;
+    E.screen_cols = KILO_BENCH_COLS;
+  } else if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) {
+    die("getWindowSize");
+  }
   E.screen_rows -= 2;
+
+  // Resizes arrive through poll(), see editorPollInput()
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) die("sigprocmask");
+  E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (E.sigfd == -1) die("signalfd");
 }
 
 int main(int argc, char *argv[]) {
+  if (argc >= 3 && !strcmp(argv[1], "--bench"))
+    return benchMain(argv[2], argc >= 4 ? argv[3] : NULL);
+
+  char *record = getenv("KILO_RECORD");
+  E.bench.record = -1;
+  if (record && (E.bench.record = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    die("open");
+
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
-  }
+  for (int i = 1; i < argc; i++) editorOpenBuffer(argv[i]);
+  editorSwitchBuffer(0);
 
   editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    "HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-Z/Y undo/redo | Ctrl-F/R find/regex | "
+    "Ctrl-O open | Ctrl-N/B buffers | Ctrl-P perf");
 
   while (1) {
     editorRefreshScreen();
     editorProcessKeypress();
+    editorProcessPending();
   }
 
   return 0;